@@ -1,61 +1,143 @@
 #include "cbuffer.h"
 #ifdef __KERNEL__
 #include <linux/vmalloc.h> /* vmalloc()/vfree()*/
+#include <linux/mm.h> /* PAGE_SIZE */
 #include <asm/string.h> /* memcpy() */
+#include <asm/system.h> /* smp_mb() */
+#include <asm/uaccess.h> /* copy_{to,from}_user() */
+#define cb_mb()		smp_mb()
+#define cb_rmb()	smp_rmb()
+#define cb_wmb()	smp_wmb()
 #else
 #include <stdlib.h>
 #include <string.h>
+#define cb_mb()		__sync_synchronize()
+#define cb_rmb()	__sync_synchronize()
+#define cb_wmb()	__sync_synchronize()
 #endif
 
 #ifndef NULL
 #define NULL 0
 #endif
 
+/* The indices may be changed concurrently by the other side (or by user space) */
+#define CB_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+/*
+ * Indices run over [0 .. 2*max_size-1] so that a full buffer (size max_size)
+ * and an empty one (size 0) can be told apart with no extra field.
+ */
+
+/* Reads an index. It may live in user-writable memory: keep it in range */
+static inline unsigned int load_index ( cbuffer_t* cbuffer, unsigned int* idx )
+{
+	return CB_ONCE(*idx) % (2*cbuffer->max_size);
+}
+
+/* Position in the raw byte vector of an index */
+static inline unsigned int index_pos ( cbuffer_t* cbuffer, unsigned int idx )
+{
+	return (idx < cbuffer->max_size) ? idx : idx-cbuffer->max_size;
+}
+
+static inline unsigned int index_add ( cbuffer_t* cbuffer, unsigned int idx, unsigned int n )
+{
+	return (idx+n) % (2*cbuffer->max_size);
+}
+
+static inline unsigned int ring_size ( cbuffer_t* cbuffer, unsigned int head, unsigned int tail )
+{
+	unsigned int size=(tail+2*cbuffer->max_size-head) % (2*cbuffer->max_size);
+
+	/* Only possible with corrupted indices */
+	return (size > cbuffer->max_size) ? cbuffer->max_size : size;
+}
+
+/* Copies nr_items into the ring from index idx on (at most two segments) */
+static void copy_to_ring ( cbuffer_t* cbuffer, unsigned int idx, const char* items, int nr_items)
+{
+	unsigned int pos=index_pos(cbuffer,idx);
+	int items_copied=nr_items;
+
+	if (pos+nr_items > cbuffer->max_size)
+		items_copied=cbuffer->max_size-pos;
+
+	memcpy(&cbuffer->data[pos],items,items_copied);
+	if (nr_items-items_copied)
+		memcpy(cbuffer->data,items+items_copied,nr_items-items_copied);
+}
+
+/* Copies nr_items out of the ring from index idx on (at most two segments) */
+static void copy_from_ring ( cbuffer_t* cbuffer, unsigned int idx, char* items, int nr_items)
+{
+	unsigned int pos=index_pos(cbuffer,idx);
+	int items_copied=nr_items;
+
+	if (pos+nr_items > cbuffer->max_size)
+		items_copied=cbuffer->max_size-pos;
+
+	memcpy(items,&cbuffer->data[pos],items_copied);
+	if (nr_items-items_copied)
+		memcpy(items+items_copied,cbuffer->data,nr_items-items_copied);
+}
+
 /* Create cbuffer */
 cbuffer_t* create_cbuffer_t (unsigned int max_size)
 {
+	unsigned int data_offset;
+	cbuffer_t *cbuffer;
+
+	if (max_size == 0)
+		return NULL;
 #ifdef __KERNEL__ 
-	cbuffer_t *cbuffer= (cbuffer_t *)vmalloc(sizeof(cbuffer_t));
+	cbuffer= (cbuffer_t *)vmalloc(sizeof(cbuffer_t));
 #else
-	cbuffer_t *cbuffer= (cbuffer_t *)malloc(sizeof(cbuffer_t));
+	cbuffer= (cbuffer_t *)malloc(sizeof(cbuffer_t));
 #endif
 	if (cbuffer == NULL)
 	{
 	    return NULL;
 	}
-	cbuffer->size=0;
-	cbuffer->head=0;
 	cbuffer->max_size=max_size;
 
-	/* Stores bytes */
+	/* Header and bytes in a single block, data page aligned in the kernel */
 #ifdef __KERNEL__ 
-	cbuffer->data=vmalloc(max_size);
+	data_offset=PAGE_SIZE;
+	cbuffer->mem_size=data_offset+PAGE_ALIGN(max_size);
+	/* Zeroed and mappable to user space with remap_vmalloc_range() */
+	cbuffer->ring=vmalloc_user(cbuffer->mem_size);
 #else
-	cbuffer->data=malloc(max_size);
+	data_offset=sizeof(cbuffer_ring_t);
+	cbuffer->mem_size=data_offset+max_size;
+	cbuffer->ring=calloc(1,cbuffer->mem_size);
 #endif
-	if ( cbuffer->data == NULL)
+	if ( cbuffer->ring == NULL)
 	{
 #ifdef __KERNEL__ 
-		vfree(cbuffer->data);
+		vfree(cbuffer);
 #else
-		free(cbuffer->data);
+		free(cbuffer);
 #endif
 		return NULL;
 	}
+	cbuffer->ring->head=0;
+	cbuffer->ring->tail=0;
+	cbuffer->ring->max_size=max_size;
+	cbuffer->ring->data_offset=data_offset;
+	cbuffer->ring->waiters=0;
+	cbuffer->data=(char*)cbuffer->ring+data_offset;
 	return cbuffer;
 }
 
 /* Release memory from circular buffer  */
 void destroy_cbuffer_t ( cbuffer_t* cbuffer )
 {
-    cbuffer->size=0;
-    cbuffer->head=0;
     cbuffer->max_size=0;
 #ifdef __KERNEL__ 
-    vfree(cbuffer->data);
+    vfree(cbuffer->ring);
     vfree(cbuffer);
 #else
-    free(cbuffer->data);
+    free(cbuffer->ring);
     free(cbuffer);
 #endif
 }
@@ -63,135 +145,132 @@ void destroy_cbuffer_t ( cbuffer_t* cbuffer )
 /* Returns the number of elements in the buffer */
 int size_cbuffer_t ( cbuffer_t* cbuffer )
 {
-	return cbuffer->size ;
+	return ring_size(cbuffer,
+			load_index(cbuffer,&cbuffer->ring->head),
+			load_index(cbuffer,&cbuffer->ring->tail));
 }
 
 int nr_gaps_cbuffer_t ( cbuffer_t* cbuffer )
 {
-	return cbuffer->max_size-cbuffer->size;
+	return cbuffer->max_size-size_cbuffer_t(cbuffer);
 }
 
 /* Return a non-zero value when buffer is full */
 int is_full_cbuffer_t ( cbuffer_t* cbuffer )
 {
-	return ( cbuffer->size == cbuffer->max_size ) ;
+	return ( size_cbuffer_t(cbuffer) == cbuffer->max_size ) ;
 }
 
 /* Return a non-zero value when buffer is empty */
 int is_empty_cbuffer_t ( cbuffer_t* cbuffer )
 {
-	return ( cbuffer->size == 0 ) ;
+	return ( size_cbuffer_t(cbuffer) == 0 ) ;
+}
+
+/* Removes every element in the buffer */
+void clear_cbuffer_t ( cbuffer_t* cbuffer )
+{
+	CB_ONCE(cbuffer->ring->head)=load_index(cbuffer,&cbuffer->ring->tail);
 }
 
 
 /* Inserts an item at the end of the buffer */
 void insert_cbuffer_t ( cbuffer_t* cbuffer, char new_item )
 {
-	unsigned int pos=0;
-	/* The buffer is full */
-	if ( cbuffer->size == cbuffer->max_size )
-	{
-		/* Overwriting head position */
-		cbuffer->data[cbuffer->head]=new_item;
-		/* Now head position must be the next one*/
-		if ( cbuffer->size !=0 )
-			cbuffer->head= ( cbuffer->head+1 ) % cbuffer->max_size;
-		/* Size remains constant*/
-	}
-	else
-	{
-		if ( cbuffer->max_size!=0 )
-			pos= ( cbuffer->head+cbuffer->size ) % cbuffer->max_size;
-		cbuffer->data[pos]=new_item;
-		cbuffer->size++;
-	}
+	insert_items_cbuffer_t(cbuffer,&new_item,1);
 }
 
 /* Inserts nr_items into the buffer */
 void insert_items_cbuffer_t ( cbuffer_t* cbuffer, const char* items, int nr_items)
 {
-	int nr_items_left=nr_items;
-	int items_copied;
-	int nr_gaps=cbuffer->max_size-cbuffer->size;
-	int whead=(cbuffer->head+cbuffer->size)%cbuffer->max_size;
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+	int nr_gaps=cbuffer->max_size-ring_size(cbuffer,head,tail);
 	
 	/* Restriction: nr_items can't be greater than the max buffer size) */
 	if (nr_items>cbuffer->max_size)
 		return;
 	
-	/* Check if we can't store all items at the end of the buffer */
-	if (whead+nr_items_left > cbuffer->max_size)
-	{
-		items_copied=cbuffer->max_size-whead;
-		memcpy(&cbuffer->data[whead],items,items_copied);
-		nr_items_left-=items_copied;
-		items+=items_copied; //Move the pointer forward
-		whead=0;		
-	}
+	/* Read head before writing over the gaps it frees */
+	cb_mb();
+	copy_to_ring(cbuffer,tail,items,nr_items);
+	/* The items must be visible before the new tail */
+	cb_wmb();
 	
-	/* If we still have to copy elements -> do it*/
-	if (nr_items_left)
-	{
-		memcpy(&cbuffer->data[whead],items,nr_items_left);
-		whead+=nr_items_left;
-	}
+	/* head moves in the event we overwrite stuff */
+	if (nr_gaps<nr_items)
+		CB_ONCE(cbuffer->ring->head)=index_add(cbuffer,head,nr_items-nr_gaps);
 	
-	/* Update size and head */
-	if (nr_gaps>=nr_items)
-	{
-		cbuffer->size+=nr_items;
-	}else
-	{
-		cbuffer->size=cbuffer->max_size;
-		/* head moves in the event we overwrite stuff */
-		cbuffer->head=(cbuffer->head+(nr_items-nr_gaps))% cbuffer->max_size;
-	}
+	/* Update tail */
+	CB_ONCE(cbuffer->ring->tail)=index_add(cbuffer,tail,nr_items);
 }
 
 /* Removes nr_items from the buffer and returns a copy of them */
 void remove_items_cbuffer_t ( cbuffer_t* cbuffer, char* items, int nr_items)
 {
-	int nr_items_left=nr_items;
-	int items_copied;
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
 	
 	/* Restriction: nr_items can't be greater than the buffer size (Ignore)) */
-	if (nr_items>cbuffer->size)
+	if (nr_items>ring_size(cbuffer,head,tail))
 		return;	
 	
-	/* Check if we can't store all items at the end of the buffer */
-	if (cbuffer->head+nr_items_left > cbuffer->max_size)
-	{
-		items_copied=cbuffer->max_size-cbuffer->head;
-		memcpy(items,&cbuffer->data[cbuffer->head],items_copied);
-		nr_items_left-=items_copied;
-		items+=items_copied; //Move the pointer forward
-		cbuffer->head=0;		
-	}
-	
-	
-	/* If we still have to copy elements -> do it*/
-	if (nr_items_left)
-	{
-		memcpy(items,&cbuffer->data[cbuffer->head],nr_items_left);
-		cbuffer->head+=nr_items_left;
-	}
+	/* Read tail before the items it publishes */
+	cb_rmb();
+	copy_from_ring(cbuffer,head,items,nr_items);
+	/* Done with the items before handing the gaps back */
+	cb_mb();
 	
-	/* Update size */
-	cbuffer->size-=nr_items;
+	/* Update head */
+	CB_ONCE(cbuffer->ring->head)=index_add(cbuffer,head,nr_items);
 }
 
+/* Copies the first nr_items in the buffer, leaving them there */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, char* items, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+
+	/* Restriction: nr_items can't be greater than the buffer size (Ignore)) */
+	if (nr_items>ring_size(cbuffer,head,tail))
+		return;
+
+	cb_rmb();
+	copy_from_ring(cbuffer,head,items,nr_items);
+}
+
+/* Discards the first nr_items in the buffer */
+void skip_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+
+	if (nr_items>ring_size(cbuffer,head,tail))
+		nr_items=ring_size(cbuffer,head,tail);
+
+	cb_mb();
+	CB_ONCE(cbuffer->ring->head)=index_add(cbuffer,head,nr_items);
+}
+
+/* Moves tail back over the last nr_items inserted */
+void unwind_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+
+	if (nr_items>ring_size(cbuffer,head,tail))
+		nr_items=ring_size(cbuffer,head,tail);
+
+	CB_ONCE(cbuffer->ring->tail)=index_add(cbuffer,tail,2*cbuffer->max_size-nr_items);
+}
 
 /* Remove first element in the buffer */
 char remove_cbuffer_t ( cbuffer_t* cbuffer)
 {
 	char ret='\0';
 	
-	if ( cbuffer->size !=0 )
-	{
-		ret=cbuffer->data[cbuffer->head];	
-		cbuffer->head= ( cbuffer->head+1 ) % cbuffer->max_size;
-		cbuffer->size--;
-	}
+	if ( !is_empty_cbuffer_t(cbuffer) )
+		remove_items_cbuffer_t(cbuffer,&ret,1);
 	
 	return ret;
 }
@@ -199,12 +278,139 @@ char remove_cbuffer_t ( cbuffer_t* cbuffer)
 /* Returns the first element in the buffer */
 char* head_cbuffer_t ( cbuffer_t* cbuffer )
 {
-	if ( cbuffer->size !=0 )
-		return &cbuffer->data[cbuffer->head];
+	if ( !is_empty_cbuffer_t(cbuffer) )
+		return &cbuffer->data[index_pos(cbuffer,load_index(cbuffer,&cbuffer->ring->head))];
 	else{
 		return NULL;
 	}
 }
 
+/* Moves every element from src to the end of dst (if they fit) */
+void transfer_cbuffer_t ( cbuffer_t* dst, cbuffer_t* src )
+{
+	unsigned int head=load_index(src,&src->ring->head);
+	unsigned int tail=load_index(src,&src->ring->tail);
+	unsigned int pos=index_pos(src,head);
+	int size=ring_size(src,head,tail);
+	int items_copied=size;
+
+	/* Restriction: dst needs room for every element in src */
+	if (size>nr_gaps_cbuffer_t(dst))
+		return;
+
+	/* At most two segments, copied straight into dst */
+	cb_rmb();
+	if (pos+size > src->max_size)
+		items_copied=src->max_size-pos;
+	insert_items_cbuffer_t(dst,&src->data[pos],items_copied);
+	if (size-items_copied)
+		insert_items_cbuffer_t(dst,src->data,size-items_copied);
+
+	CB_ONCE(src->ring->head)=tail;
+}
+
+/* Publishes who sleeps waiting on the buffer */
+void set_waiters_cbuffer_t ( cbuffer_t* cbuffer, unsigned int waiters )
+{
+	CB_ONCE(cbuffer->ring->waiters)=waiters;
+	/* The bits must be visible before the sleeper checks the indices again */
+	cb_mb();
+}
+
+#ifdef __KERNEL__
+/* Inserts nr_items from user space into the buffer (at most two segments) */
+int insert_items_from_user_cbuffer_t ( cbuffer_t* cbuffer, const char __user* items, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+	unsigned int whead=index_pos(cbuffer,tail);
+	int nr_copied=0;
+	int chunk, not_copied;
+
+	/* Restriction: nr_items can't be greater than the free gaps (no overwrite) */
+	if (nr_items>cbuffer->max_size-ring_size(cbuffer,head,tail))
+		return 0;
+
+	cb_mb();
+	while (nr_copied<nr_items)
+	{
+		chunk=nr_items-nr_copied;
+		if (whead+chunk > cbuffer->max_size)
+			chunk=cbuffer->max_size-whead;
+
+		not_copied=copy_from_user(&cbuffer->data[whead],items+nr_copied,chunk);
+		nr_copied+=chunk-not_copied;
+		if (not_copied)
+			break; /* Fault: keep only what was really copied */
+		whead=0;
+	}
+	cb_wmb();
+
+	/* Update tail */
+	CB_ONCE(cbuffer->ring->tail)=index_add(cbuffer,tail,nr_copied);
+	return nr_copied;
+}
+
+/* Copies nr_items from offset on into user space, without removing them */
+int peek_items_to_user_cbuffer_t ( cbuffer_t* cbuffer, char __user* items, int offset, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+	unsigned int rhead=index_pos(cbuffer,index_add(cbuffer,head,offset));
+	int nr_copied=0;
+	int chunk, not_copied;
+
+	/* Restriction: the items must be in the buffer */
+	if (offset<0 || offset+nr_items>ring_size(cbuffer,head,tail))
+		return 0;
 
+	cb_rmb();
+	while (nr_copied<nr_items)
+	{
+		chunk=nr_items-nr_copied;
+		if (rhead+chunk > cbuffer->max_size)
+			chunk=cbuffer->max_size-rhead;
 
+		not_copied=copy_to_user(items+nr_copied,&cbuffer->data[rhead],chunk);
+		nr_copied+=chunk-not_copied;
+		if (not_copied)
+			break;
+		rhead=0;
+	}
+
+	return nr_copied;
+}
+
+/* Removes nr_items from the buffer into user space (at most two segments) */
+int remove_items_to_user_cbuffer_t ( cbuffer_t* cbuffer, char __user* items, int nr_items)
+{
+	unsigned int head=load_index(cbuffer,&cbuffer->ring->head);
+	unsigned int tail=load_index(cbuffer,&cbuffer->ring->tail);
+	unsigned int rhead=index_pos(cbuffer,head);
+	int nr_copied=0;
+	int chunk, not_copied;
+
+	/* Restriction: nr_items can't be greater than the buffer size */
+	if (nr_items>ring_size(cbuffer,head,tail))
+		return 0;
+
+	cb_rmb();
+	while (nr_copied<nr_items)
+	{
+		chunk=nr_items-nr_copied;
+		if (rhead+chunk > cbuffer->max_size)
+			chunk=cbuffer->max_size-rhead;
+
+		not_copied=copy_to_user(items+nr_copied,&cbuffer->data[rhead],chunk);
+		nr_copied+=chunk-not_copied;
+		if (not_copied)
+			break; /* Fault: what wasn't copied stays in the buffer */
+		rhead=0;
+	}
+	cb_mb();
+
+	/* Update head */
+	CB_ONCE(cbuffer->ring->head)=index_add(cbuffer,head,nr_copied);
+	return nr_copied;
+}
+#endif
@@ -1,13 +1,35 @@
 #ifndef CBUFFER_H
 #define CBUFFER_H
 
+#ifdef __KERNEL__
+#include <linux/compiler.h> /* __user */
+#endif
+
+/* Bits of cbuffer_ring_t.waiters */
+#define CBUFFER_WAIT_DATA	0x1	/* A consumer sleeps waiting for data */
+#define CBUFFER_WAIT_SPACE	0x2	/* A producer sleeps waiting for gaps */
 
+/*
+ * Ring header. It sits at the start of the memory block that holds the data,
+ * so the whole block can be shared with user space (mmap). The producer only
+ * moves tail and the consumer only moves head (single producer/consumer).
+ */
 typedef struct
 {
-    char* data;			/* raw byte vector */
-	unsigned int head;		/* Index of the first element // head in [0 .. max_size-1] */
-	unsigned int size;		/* Current Buffer size // size in [0 .. max_size] */
+	unsigned int head;		/* Read index  // head in [0 .. 2*max_size-1] */
+	unsigned int tail;		/* Write index // tail in [0 .. 2*max_size-1] */
 	unsigned int max_size;  	/* Buffer max capacity */
+	unsigned int data_offset;	/* Offset of the raw byte vector from the header */
+	unsigned int waiters;		/* CBUFFER_WAIT_* */
+}
+cbuffer_ring_t;
+
+typedef struct
+{
+    char* data;			/* raw byte vector */
+	cbuffer_ring_t* ring;		/* Indices (shared memory block) */
+	unsigned int max_size;  	/* Buffer max capacity (private copy) */
+	unsigned int mem_size;		/* Size of the memory block (header+data) */
 }
 cbuffer_t;
 
@@ -30,6 +52,9 @@ int is_full_cbuffer_t ( cbuffer_t* cbuffer );
 /* Returns a non-zero value when buffer is empty */
 int is_empty_cbuffer_t ( cbuffer_t* cbuffer );
 
+/* Removes every element in the buffer */
+void clear_cbuffer_t ( cbuffer_t* cbuffer );
+
 /* Inserts an item at the end of the buffer */
 void insert_cbuffer_t ( cbuffer_t* cbuffer, char new_item );
 
@@ -42,7 +67,36 @@ char remove_cbuffer_t ( cbuffer_t* cbuffer);
 /* Removes nr_items from the buffer and returns a copy of them */
 void remove_items_cbuffer_t ( cbuffer_t* cbuffer, char* items, int nr_items);
 
+/* Copies the first nr_items in the buffer without removing them */
+void peek_items_cbuffer_t ( cbuffer_t* cbuffer, char* items, int nr_items);
+
+/* Discards the first nr_items in the buffer */
+void skip_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items);
+
+/* Takes back the last nr_items inserted (the producer undoes a write) */
+void unwind_items_cbuffer_t ( cbuffer_t* cbuffer, int nr_items);
+
 /* Returns a pointer to the first element in the buffer */
 char* head_cbuffer_t ( cbuffer_t* cbuffer );
 
+/* Moves every element from src to the end of dst (if they fit) */
+void transfer_cbuffer_t ( cbuffer_t* dst, cbuffer_t* src );
+
+/* Publishes the CBUFFER_WAIT_* bits in the ring header (full barrier) */
+void set_waiters_cbuffer_t ( cbuffer_t* cbuffer, unsigned int waiters );
+
+#ifdef __KERNEL__
+/* Inserts nr_items copied straight from user space into the buffer.
+   Returns the number of items actually inserted (less on a fault) */
+int insert_items_from_user_cbuffer_t ( cbuffer_t* cbuffer, const char __user* items, int nr_items);
+
+/* Copies nr_items starting offset items past the first one straight to user
+   space, leaving them in the buffer. Returns the number of items copied */
+int peek_items_to_user_cbuffer_t ( cbuffer_t* cbuffer, char __user* items, int offset, int nr_items);
+
+/* Removes nr_items from the buffer copying them straight to user space.
+   Returns the number of items actually removed (less on a fault) */
+int remove_items_to_user_cbuffer_t ( cbuffer_t* cbuffer, char __user* items, int nr_items);
+#endif
+
 #endif
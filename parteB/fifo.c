@@ -1,18 +1,52 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/vmalloc.h>
 #include <asm-generic/uaccess.h>
 #include <asm-generic/errno.h>
 #include <linux/semaphore.h>
-#include "cbuffer.h"
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/bitops.h>
+#include <linux/limits.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/capability.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/aio.h>
+#include <linux/ioctl.h>
+#include <asm/ioctls.h>
+#include <linux/rcupdate.h>
+#include <linux/err.h>
+#include "fifo.h"
+
+#define CREATE_TRACE_POINTS
+#include "fifo_trace.h"
+
 /*
- *  Lecturas o escritura de mas de BUF_LEN -> Error
+ *  Escrituras de hasta PIPE_BUF bytes (o la capacidad, si es menor) son
+ *  ATOMICAS; las mayores se van volcando por trozos según hay hueco
  *  Al abrir un FIFO en lectura se BLOQUEA hasta habrir la escritura y viceversa
  *  El PRODUCTOR se BLOQUEA si no hay hueco
- *  El CONSUMIDOR se BLOQUEA si no tiene todo lo que pide
+ *  El CONSUMIDOR se BLOQUEA si no tiene todo lo que pide (como mucho la
+ *  capacidad del buffer: si pide más se lleva lo que haya con el FIFO lleno)
+ *  En lectura parcial (FIFO_MODE_PARTIAL) solo espera a tener lowat bytes
+ *  (1 por defecto) y se lleva lo que haya, como read(2) en un pipe
  *  Lectura a FIFO VACIO sin PRODUCTORES -> EOF 0
  *  Escritura a FIFO sin CONSUMIDOR -> Error
+ *  Cada minor [0 .. nr_fifos-1] es un FIFO independiente
+ *  Con O_NONBLOCK nada se BLOQUEA: open no espera al otro extremo y si no
+ *  se puede avanzar read/write devuelven -EAGAIN (read entrega lo que haya)
+ *  Abierto O_RDWR es productor y consumidor a la vez y se puede mapear el
+ *  anillo (ver fifo_ioctl.h)
  */
 
 int init_module(void);
@@ -21,334 +55,2501 @@ static int fifo_open(struct inode *, struct file *);
 static int fifo_release(struct inode *, struct file *);
 static ssize_t fifo_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t fifo_write(struct file * ,const char __user * ,size_t ,loff_t *);
+static ssize_t fifo_aio_read(struct kiocb *, const struct iovec *,
+                    unsigned long, loff_t);
+static ssize_t fifo_aio_write(struct kiocb *, const struct iovec *,
+                    unsigned long, loff_t);
+static unsigned int fifo_poll(struct file *, poll_table *);
+static ssize_t fifo_splice_read(struct file *, loff_t *,
+                    struct pipe_inode_info *, size_t, unsigned int);
+static ssize_t fifo_splice_write(struct pipe_inode_info *, struct file *,
+                    loff_t *, size_t, unsigned int);
+static long fifo_ioctl(struct file *, unsigned int, unsigned long);
+static int fifo_mmap(struct file *, struct vm_area_struct *);
+
+MODULE_AUTHOR("R.S.R.");
+MODULE_DESCRIPTION("FIFO como dispositivo de caracteres");
+MODULE_LICENSE("GPL");
+
+static unsigned int nr_fifos = NR_FIFOS;
+module_param(nr_fifos, uint, 0444);
+MODULE_PARM_DESC(nr_fifos, "Numero de FIFOs independientes (minors 0..nr_fifos-1)");
+
+static unsigned int fifo_size = BUF_LEN;
+module_param(fifo_size, uint, 0444);
+MODULE_PARM_DESC(fifo_size, "Capacidad inicial de cada FIFO en bytes");
+
+static unsigned int fifo_max_size = FIFO_MAX_SIZE;
+module_param(fifo_max_size, uint, 0644);
+MODULE_PARM_DESC(fifo_max_size, "Capacidad maxima con FIFO_IOC_SET_SIZE sin CAP_SYS_RESOURCE");
+
+static fifo_t* fifos;
+
+static inline fifo_t *fifo_of(struct file *filp)
+{
+    return ((fifo_file_t *)filp->private_data)->fifo;
+}
 
-#define DEVICE_NAME "fifodev"
-#define BUF_LEN 512
-#define FIFO_DEBUG
-//#define DEBUG_VERBOSE
-
-cbuffer_t* cbuffer;
-
-int num_prod = 0;
-int num_cons = 0;
-
-int num_bloq_prod = 0;
-int num_bloq_cons = 0;
-
-
-DEFINE_SEMAPHORE(mutex);
-struct semaphore cola_prod, cola_cons;
-
-#ifdef FIFO_DEBUG
-    #define DBG(format, arg...) do { \
-        printk(KERN_DEBUG "%s: " format "\n" , __func__ , ## arg); \
-    } while (0)
-
-    #ifdef DEBUG_VERBOSE
-        #define DBGV DBG
-    #else
-        #define DBGV(format, args...) /* */
-    #endif
-#else
-    #define DBG(format, arg...) /* */
-    #define DBGV(format, args...) /* */
-#endif
-
-#define cond_wait(mtx, cond, count, interrupt_InterruptHandler) \
-    do { \
-        count++; \
-        up(mtx); \
-        DBGV("Me voy a dormir en "#cond" con "#count": %d", count); \
-        if (down_interruptible(cond)){ \
-            DBGV("[INT] Despertado de "#cond" por interrupción }:(");\
-            down(mtx); \
-            count--; \
-            up(mtx); \
-            interrupt_InterruptHandler \
-            return -EINTR; \
-        } \
-        DBGV("Me han despertado de "#cond);\
-        if (down_interruptible(mtx)){ \
-            interrupt_InterruptHandler \
-            return -EINTR; \
-        }\
-    } while(0)
-
-#define cond_signal(cond) up(cond)
-
-#define __InterruptHandler__
+/*
+ *  Los durmientes esperan de forma exclusiva. Quien despierta pasa como
+ *  clave un presupuesto (bytes o huecos disponibles) y solo se despierta a
+ *  quienes les alcanza, descontándolo. Sin presupuesto (NULL) es un cambio
+ *  de estado del FIFO (aperturas y cierres) y se despierta a todos.
+ */
+static int fifo_wake_function(wait_queue_t *wait, unsigned mode,
+                                int sync, void *key)
+{
+    fifo_waiter_t *waiter = container_of(wait, fifo_waiter_t, wait);
+    int *budget = key;
 
+    if (budget){
+        if (*budget < waiter->needed)
+            return 0;
+        *budget -= waiter->needed;
+    }
 
-static int Major;  
+    return autoremove_wake_function(wait, mode, sync, key);
+}
 
-static struct file_operations fops = {
-    .read = fifo_read,
-    .write = fifo_write,
-    .open = fifo_open,
-    .release = fifo_release
-};
+/*
+ *  Publica en la cabecera del anillo compartido quién está esperando. De
+ *  quien está en poll/epoll no se sabe a qué espera (ni cuándo se va), así
+ *  que mientras haya alguno se piden los dos avisos.
+ */
+static void fifo_update_waiters(fifo_t *fifo)
+{
+    unsigned int polling = waitqueue_active(&fifo->cola_poll) ?
+                            CBUFFER_WAIT_DATA | CBUFFER_WAIT_SPACE : 0;
 
+    set_waiters_cbuffer_t(fifo->cbuffer, polling |
+            (fifo->num_bloq_cons ? CBUFFER_WAIT_DATA : 0) |
+            (fifo->num_bloq_prod ? CBUFFER_WAIT_SPACE : 0));
+}
 
+static void __fifo_wake_cons(fifo_t *fifo, int force);
+static void __fifo_wake_prod(fifo_t *fifo, int force);
 
-int init_module(void)
+// ¿Tiene ya quien duerme en cond lo que necesita?
+static int fifo_ready(fifo_t *fifo, wait_queue_head_t *cond, int needed)
 {
-    Major = register_chrdev(0, DEVICE_NAME, &fops);
+    if (cond == &fifo->cola_cons)
+        return size_cbuffer_t(fifo->cbuffer) >= needed;
+    if (cond == &fifo->cola_prio)
+        return nr_gaps_cbuffer_t(fifo->prio) >= needed;
+    return nr_gaps_cbuffer_t(fifo->cbuffer) >= needed;
+}
 
-    if (Major < 0) {
-        printk(KERN_ALERT "Registering char device failed with %d\n", Major);
-        return Major;
+/*
+ *  Duerme en cond hasta que nos despierten. Se llama con fifo->mutex cogido;
+ *  devuelve 0 con el mutex cogido o -EINTR sin él.
+ */
+static int cond_wait(fifo_t *fifo, wait_queue_head_t *cond,
+                        int *count, int needed)
+{
+    fifo_waiter_t waiter = {
+        .wait = {
+            .private = current,
+            .func = fifo_wake_function,
+            .task_list = LIST_HEAD_INIT(waiter.wait.task_list),
+        },
+        .needed = needed,
+    };
+    int woken, ready, prod = (cond != &fifo->cola_cons);
+    u64 start = 0;
+
+    (*count)++;
+    if (prod)
+        fifo_stat_inc(fifo, bloq_prod);
+    else
+        fifo_stat_inc(fifo, bloq_cons);
+    prepare_to_wait_exclusive(cond, &waiter.wait, TASK_INTERRUPTIBLE);
+
+    // Un extremo que usa el anillo por mmap puede haber publicado datos o
+    // huecos sin el mutex: una vez anunciado que dormimos se vuelve a mirar.
+    fifo_update_waiters(fifo);
+    ready = needed && fifo_ready(fifo, cond, needed);
+
+    // Si el otro lado espera a su marca, quien tenía que llevarle hasta ella
+    // somos nosotros y ya no avanzamos: se le despierta con lo que haya.
+    if (prod)
+        __fifo_wake_cons(fifo, 1);
+    else
+        __fifo_wake_prod(fifo, 1);
+    up(&fifo->mutex);
+
+    if (!ready){
+        trace_fifo_block(fifo, prod, needed);
+        start = local_clock();
+        schedule();
     }
 
-    if((cbuffer = create_cbuffer_t(BUF_LEN)) == NULL)
-        return -ENOMEM;
+    woken = list_empty_careful(&waiter.wait.task_list);
+    finish_wait(cond, &waiter.wait);
 
-    sema_init(&cola_cons, 0);
-    sema_init(&cola_prod, 0);
-    sema_init(&wait_friend, 0);
+    if (start){
+        trace_fifo_wakeup(fifo, prod, signal_pending(current));
+        if (prod)
+            fifo_lat_add(fifo, bloq_prod, start);
+        else
+            fifo_lat_add(fifo, bloq_cons, start);
+    }
 
-    DBG("I was assigned major number %d. To talk to\n", Major);
-    DBG("the driver, create a dev file with\n");
-    DBG("'mknod /var/tmp/fifo -m 666 c %d 0'.\n", Major);
-    DBG("Remove the device file and module when done.\n");
+    down(&fifo->mutex);
+    (*count)--;
+    fifo_update_waiters(fifo);
+
+    if (signal_pending(current)){
+        // Si nos tocaba avanzar, se lo pasamos al siguiente de la cola.
+        if (woken)
+            wake_up_interruptible_nr(cond, 1);
+        up(&fifo->mutex);
+        return -EINTR;
+    }
 
     return 0;
 }
 
-void cleanup_module(void)
+/*
+ *  Por debajo de su marca no se despierta a nadie todavía: se arma el
+ *  temporizador (si lo hay) para que el retraso esté acotado. Llenar el
+ *  buffer no basta para saltarse la marca (con escrituras atómicas o en
+ *  paquetes puede no llenarse nunca del todo): la marca solo vale mientras
+ *  el otro lado no tenga a nadie dormido, y quien se va a dormir despierta
+ *  antes al de enfrente (ver cond_wait).
+ */
+static void fifo_arm_flush(fifo_t *fifo)
 {
-    unregister_chrdev(Major, DEVICE_NAME);
-    destroy_cbuffer_t(cbuffer);
+    u64 ns = ACCESS_ONCE(fifo->flush_ns);
+
+    if (ns && !hrtimer_active(&fifo->flush_timer))
+        hrtimer_start(&fifo->flush_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
 }
 
+// Una marca nunca pasa de la capacidad
+static inline int fifo_wmark_level(fifo_t *fifo, unsigned int *wmark)
+{
+    return min_t(unsigned int, ACCESS_ONCE(*wmark), fifo->cbuffer->max_size);
+}
 
+// Las escrituras de hasta este tamaño no se intercalan con otras
+static inline int fifo_atomic_len(fifo_t *fifo)
+{
+    return min_t(int, PIPE_BUF, fifo->cbuffer->max_size);
+}
 
-static int fifo_open(struct inode *inode, struct file *file)
+// Huecos para que poll dé POLLOUT: como en un pipe, los de una escritura
+// atómica (en modo paquete, los del mensaje más corto)
+static inline int fifo_poll_space(fifo_t *fifo)
 {
-    char is_cons = file->f_mode & FMODE_READ;
+    if (fifo->mode & FIFO_MODE_PACKET)
+        return FIFO_MSG_MIN;
+    return fifo_atomic_len(fifo);
+}
 
-    DBGV("Pipe abierto para %s con lecotres %d, escriores %d", 
-            (file->f_mode & FMODE_READ)? "lectura": "escritura",
-            num_cons, 
-            num_prod);
+// Despierta a los consumidores que pueden leer con lo que hay en el buffer
+static void __fifo_wake_cons(fifo_t *fifo, int force)
+{
+    int budget;
+
+    // Lo publicado ha de verse antes de mirar las colas: quien duerme se
+    // apunta en la cola y luego vuelve a mirar el anillo (ver cond_wait)
+    smp_mb();
+    budget = size_cbuffer_t(fifo->cbuffer);
+
+    if (!budget)
+        return;
+
+    if (!force && !ACCESS_ONCE(fifo->num_bloq_prod) &&
+            budget < fifo_wmark_level(fifo, &fifo->rd_wmark)){
+        if (waitqueue_active(&fifo->cola_cons) ||
+                waitqueue_active(&fifo->cola_poll))
+            fifo_arm_flush(fifo);
+        return;
+    }
 
-    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
-    if (down_interruptible(&mutex)) 
-        return -EINTR;
+    if (waitqueue_active(&fifo->cola_cons)){
+        trace_fifo_wake(fifo, 0, budget);
+        __wake_up(&fifo->cola_cons, TASK_INTERRUPTIBLE, 0, &budget);
+    }
+    if (waitqueue_active(&fifo->cola_poll))
+        wake_up_interruptible_poll(&fifo->cola_poll, POLLIN | POLLRDNORM);
+}
 
-    if (is_cons){ 
-        // Eres consumidor
-        num_cons++;
-        while(num_bloq_prod){
-            num_bloq_prod--;
-            up(&cola_prod);
-        }
-        
-        while(!num_prod)
-            cond_wait(&mutex, &cola_cons, num_bloq_cons,
-                __InterruptHandler__ { 
-                    down(&mutex);
-                    num_cons--;
-                    up(&mutex);
-                }
-            );
-
-    }else{ 
-        // Eres un productor.
-        num_prod++;
-        while(num_bloq_cons){
-            num_bloq_cons--;
-            up(&cola_cons);
-	}
-        
-        while(!num_cons)
-            cond_wait(&mutex, &cola_prod, num_bloq_prod,
-                __InterruptHandler__ { 
-                    down(&mutex);
-                    num_prod--;
-                    up(&mutex);
-                }
-            );
+// Despierta a los productores que caben en los huecos del buffer
+static void __fifo_wake_prod(fifo_t *fifo, int force)
+{
+    int budget;
+
+    smp_mb();
+    budget = nr_gaps_cbuffer_t(fifo->cbuffer);
+
+    if (!budget)
+        return;
+
+    if (!force && !ACCESS_ONCE(fifo->num_bloq_cons) &&
+            budget < fifo_wmark_level(fifo, &fifo->wr_wmark)){
+        if (waitqueue_active(&fifo->cola_prod) ||
+                waitqueue_active(&fifo->cola_poll))
+            fifo_arm_flush(fifo);
+        return;
     }
 
-    up(&mutex);
-        
-    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-    try_module_get(THIS_MODULE);
+    if (waitqueue_active(&fifo->cola_prod)){
+        trace_fifo_wake(fifo, 1, budget);
+        __wake_up(&fifo->cola_prod, TASK_INTERRUPTIBLE, 0, &budget);
+    }
+    if (waitqueue_active(&fifo->cola_poll) && budget >= fifo_poll_space(fifo))
+        wake_up_interruptible_poll(&fifo->cola_poll, POLLOUT | POLLWRNORM);
+}
 
-    return 0;
+static void fifo_wake_cons(fifo_t *fifo)
+{
+    __fifo_wake_cons(fifo, 0);
 }
 
+static void fifo_wake_prod(fifo_t *fifo)
+{
+    __fifo_wake_prod(fifo, 0);
+}
 
-static int fifo_release(struct inode *inode, struct file *file)
+/*
+ *  Carril prioritario. Se usa siempre con el mutex cogido y es poco tráfico:
+ *  sin marcas, y a los consumidores se les despierta a todos (lo que
+ *  necesitan se mide en el buffer normal).
+ */
+static void fifo_wake_prio(fifo_t *fifo)
 {
-    
-    // INCIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
-    if (down_interruptible(&mutex)) 
-        return -EINTR;
+    int budget = nr_gaps_cbuffer_t(fifo->prio);
 
-    if (file->f_mode & FMODE_READ){
-        num_cons--;
-	if(num_cons == 0) // Por si hay productores durmiendo, levántalos. 
-            while(num_bloq_prod){
-	        num_bloq_prod--;
-                cond_signal(&cola_prod);
-	    }
-    }else 
-        num_prod--;
+    if (budget && waitqueue_active(&fifo->cola_prio))
+        __wake_up(&fifo->cola_prio, TASK_INTERRUPTIBLE, 0, &budget);
+}
 
+// Vence el retardo máximo: se despierta a quien pueda avanzar, sin marcas
+static enum hrtimer_restart fifo_flush_timer(struct hrtimer *timer)
+{
+    fifo_t *fifo = container_of(timer, fifo_t, flush_timer);
 
-    if( !(num_prod || num_cons) )
-        cbuffer->size = 0;
+    __fifo_wake_cons(fifo, 1);
+    __fifo_wake_prod(fifo, 1);
 
-    up(&mutex);
-    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-    
-    DBGV("Pipe de %s cerrado con lecotres %d, escriores %d", 
-            (file->f_mode & FMODE_READ)? "lectura": "escritura",
-            num_cons, 
-            num_prod);
+    return HRTIMER_NORESTART;
+}
 
-    module_put(THIS_MODULE);
+// Cambio de estado del FIFO (aperturas y cierres): despierta a toda la cola
+// y a los que hacen poll, que tendrán que ver POLLHUP/POLLERR.
+static void fifo_wake_all(fifo_t *fifo, wait_queue_head_t *cola)
+{
+    wake_up_interruptible_all(cola);
+    wake_up_interruptible_all(&fifo->cola_poll);
+}
+
+// Contadores de una llamada de lectura o escritura que ha terminado en ret
+static void fifo_account(fifo_t *fifo, ssize_t ret, int write)
+{
+    if (write){
+        fifo_stat_inc(fifo, writes);
+        if (ret > 0)
+            fifo_stat_add(fifo, bytes_in, ret);
+    }else{
+        fifo_stat_inc(fifo, reads);
+        if (ret > 0)
+            fifo_stat_add(fifo, bytes_out, ret);
+    }
+
+    if (ret == -EPIPE)
+        fifo_stat_inc(fifo, epipe);
+    else if (ret == -EINTR)
+        fifo_stat_inc(fifo, eintr);
+}
+
+// Ocupación máxima; se llama tras insertar, con el buffer estable
+static void fifo_stat_high_water(fifo_t *fifo)
+{
+    u64 used = size_cbuffer_t(fifo->cbuffer);
+
+    if (used > this_cpu_read(fifo->stats->high_water))
+        this_cpu_write(fifo->stats->high_water, used);
+}
+
+// down_interruptible del mutex del FIFO apuntando cuánto se ha esperado
+static int fifo_lock(fifo_t *fifo)
+{
+    u64 start = local_clock();
+
+    if (down_interruptible(&fifo->mutex))
+        return -EINTR;
+
+    fifo_lat_add(fifo, mutex, start);
+    return 0;
+}
 
+/*
+ *  Cada lado del anillo (lectura o escritura) lo toca un solo hilo a la vez,
+ *  con un bit de fifo->busy. Como el productor solo mueve tail y el
+ *  consumidor solo head, con eso basta para tocar el anillo sin el mutex.
+ */
+static int fifo_bit_wait(void *word)
+{
+    schedule();
     return 0;
 }
 
+static void fifo_lock_side(fifo_t *fifo, int side)
+{
+    wait_on_bit_lock(&fifo->busy, side, fifo_bit_wait, TASK_UNINTERRUPTIBLE);
+}
+
+static int fifo_trylock_side(fifo_t *fifo, int side)
+{
+    return !test_and_set_bit_lock(side, &fifo->busy);
+}
 
+static void fifo_unlock_side(fifo_t *fifo, int side)
+{
+    clear_bit_unlock(side, &fifo->busy);
+    smp_mb__after_clear_bit();
+    wake_up_bit(&fifo->busy, side);
+}
 
-static ssize_t fifo_read (struct file *filp,	
-                            char __user *buff,	
-                            size_t length,	
-                            loff_t *offset)
+// Se llama con el mutex cogido cada vez que cambian los extremos
+static void fifo_update_spsc(fifo_t *fifo)
 {
-    char *kbuff;
-    DBGV("Quiero leer %d bytes", length);
-    DBGV("Escritores esperando %d", num_bloq_prod);
+    fifo->spsc = (fifo->num_prod == 1 && fifo->num_cons == 1 &&
+                    !(fifo->mode & (FIFO_MODE_PACKET | FIFO_MODE_BROADCAST)));
+}
 
-    if (length > BUF_LEN){
-        DBG("[ERROR] Lectura demasiado grande");
-        return -EINVAL;
+// ¿Se hace sitio tirando lo más antiguo en vez de esperar?
+static inline int fifo_drops_oldest(fifo_t *fifo)
+{
+    return fifo->policy == FIFO_POLICY_DROP_OLDEST ||
+            (fifo->mode & FIFO_MODE_RECORDER);
+}
+
+// En el registrador se escribe aunque no haya consumidores
+static inline int fifo_no_readers(fifo_t *fifo)
+{
+    return fifo->num_cons == 0 && !(fifo->mode & FIFO_MODE_RECORDER);
+}
+
+/*
+ *  Copias entre el buffer y un vector de segmentos del usuario (readv,
+ *  writev; read y write usan uno solo). skip son los bytes del vector que ya
+ *  se han copiado. Devuelven lo copiado, menos de len si falla una copia.
+ */
+static int fifo_insert_iov(cbuffer_t *cbuffer, const struct iovec *iov,
+                            size_t skip, int len)
+{
+    int chunk, done, copied = 0;
+
+    if (len == 0)
+        return 0;
+
+    while (skip >= iov->iov_len){
+        skip -= iov->iov_len;
+        iov++;
     }
 
-    if((kbuff = vmalloc(length)) == NULL){
-        DBG("[ERROR] no se ha podido alojar memoria dinámica");
-        return -ENOMEM;
+    for (; copied < len; iov++, skip = 0){
+        chunk = min_t(size_t, len - copied, iov->iov_len - skip);
+        done = insert_items_from_user_cbuffer_t(cbuffer,
+                    (const char __user *)iov->iov_base + skip, chunk);
+        copied += done;
+        if (done < chunk)
+            break;
     }
 
-    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
-    if (down_interruptible(&mutex)){ 
-        DBGV("[INT] Interrumpido al intentar acceder a la SC");
-        vfree(kbuff);
-        return -EINTR;
+    return copied;
+}
+
+static int fifo_remove_iov(cbuffer_t *cbuffer, const struct iovec *iov,
+                            size_t skip, int len)
+{
+    int chunk, done, copied = 0;
+
+    if (len == 0)
+        return 0;
+
+    while (skip >= iov->iov_len){
+        skip -= iov->iov_len;
+        iov++;
     }
 
-    // Si el pipe esta vacio y no hay productores -> EOF
-    if (num_prod == 0 && is_empty_cbuffer_t(cbuffer)){
-        up(&mutex);
-        DBGV("Pipe vacio sin productores");
-        vfree(kbuff);
+    for (; copied < len; iov++, skip = 0){
+        chunk = min_t(size_t, len - copied, iov->iov_len - skip);
+        done = remove_items_to_user_cbuffer_t(cbuffer,
+                    (char __user *)iov->iov_base + skip, chunk);
+        copied += done;
+        if (done < chunk)
+            break;
+    }
+
+    return copied;
+}
+
+// Como fifo_remove_iov, pero sin sacar nada y desde offset bytes tras head
+static int fifo_peek_iov(cbuffer_t *cbuffer, const struct iovec *iov,
+                            size_t skip, int offset, int len)
+{
+    int chunk, done, copied = 0;
+
+    if (len == 0)
         return 0;
+
+    while (skip >= iov->iov_len){
+        skip -= iov->iov_len;
+        iov++;
     }
 
-    // El consumidor se bloquea si no tiene lo que pide
-    while (size_cbuffer_t(cbuffer) < length){
-        cond_wait(&mutex, &cola_cons, num_bloq_cons,
-                __InterruptHandler__ {
-                    vfree(kbuff);
-                });
-    
-        if (num_prod == 0 && is_empty_cbuffer_t(cbuffer)){
-            up(&mutex);
-	    DBGV("Pipe vacio sin productores");
-    	    vfree(kbuff);
-	    return 0;
+    for (; copied < len; iov++, skip = 0){
+        chunk = min_t(size_t, len - copied, iov->iov_len - skip);
+        done = peek_items_to_user_cbuffer_t(cbuffer,
+                    (char __user *)iov->iov_base + skip, offset + copied,
+                    chunk);
+        copied += done;
+        if (done < chunk)
+            break;
+    }
+
+    return copied;
+}
+
+/*
+ *  Lo que tiene que haber en el buffer para que una lectura de length bytes
+ *  avance: todo o, en lectura parcial, lowat. Nunca más de lo que deja
+ *  dentro un productor dormido: una escritura atómica que no cabe puede
+ *  dejar hasta fifo_atomic_len - 1 huecos libres.
+ */
+static int fifo_read_needed(fifo_t *fifo, size_t length)
+{
+    size_t needed = min_t(size_t, length,
+                    fifo->cbuffer->max_size - fifo_atomic_len(fifo) + 1);
+
+    if (ACCESS_ONCE(fifo->mode) & FIFO_MODE_PARTIAL)
+        needed = min_t(size_t, needed, ACCESS_ONCE(fifo->lowat));
+
+    return needed;
+}
+
+/*
+ *  Camino rápido con un productor y un consumidor: sin mutex, solo con el
+ *  bit de su lado. Devuelve 0 si hay que ir por el camino con cerrojo
+ *  (hay que esperar, EOF, EPIPE, varios extremos...).
+ */
+static ssize_t fifo_fast_read(fifo_t *fifo, const struct iovec *iov,
+                                size_t length)
+{
+    int needed;
+    ssize_t copied = 0;
+    u64 start;
+
+    if (!ACCESS_ONCE(fifo->spsc) || !fifo_trylock_side(fifo, FIFO_READING))
+        return 0;
+
+    // fifo_set_mode cambia spsc con los dos bits cogidos
+    if (!fifo->spsc){
+        fifo_unlock_side(fifo, FIFO_READING);
+        return 0;
+    }
+
+    // Lo prioritario se saca por el camino con cerrojo
+    needed = fifo_read_needed(fifo, length);
+    if (size_cbuffer_t(fifo->cbuffer) >= needed &&
+            is_empty_cbuffer_t(fifo->prio)){
+        needed = min_t(size_t, length, size_cbuffer_t(fifo->cbuffer));
+        start = local_clock();
+        copied = fifo_remove_iov(fifo->cbuffer, iov, 0, needed);
+        fifo_lat_add(fifo, copy, start);
+        if (copied == 0)
+            copied = -EFAULT;
+    }
+
+    // Con el bit aún cogido nadie puede cambiar el buffer (fifo_resize)
+    if (copied > 0)
+        fifo_wake_prod(fifo);
+
+    fifo_unlock_side(fifo, FIFO_READING);
+
+    return copied;
+}
+
+static ssize_t fifo_fast_write(fifo_t *fifo, const struct iovec *iov,
+                                size_t length)
+{
+    ssize_t copied = 0;
+    u64 start;
+
+    if (!ACCESS_ONCE(fifo->spsc) || !fifo_trylock_side(fifo, FIFO_WRITING))
+        return 0;
+
+    if (!fifo->spsc){
+        fifo_unlock_side(fifo, FIFO_WRITING);
+        return 0;
+    }
+
+    // Solo si cabe entera: así no hay que pensar en atomicidad ni en trozos
+    if (nr_gaps_cbuffer_t(fifo->cbuffer) >= length){
+        start = local_clock();
+        copied = fifo_insert_iov(fifo->cbuffer, iov, 0, length);
+        fifo_lat_add(fifo, copy, start);
+        if (copied == 0)
+            copied = -EFAULT;
+        fifo_stat_high_water(fifo);
+    }
+
+    if (copied > 0)
+        fifo_wake_cons(fifo);
+
+    fifo_unlock_side(fifo, FIFO_WRITING);
+
+    return copied;
+}
+
+
+/*
+ *  Difusión: el buffer va de bc_head (lo que aún no ha leído el consumidor
+ *  más lento) a la cola, y cada consumidor lee desde su cursor. Todo con el
+ *  mutex cogido.
+ */
+static u64 fifo_bcast_avail(fifo_t *fifo, fifo_file_t *ff)
+{
+    return fifo->bc_head + size_cbuffer_t(fifo->cbuffer) - ff->cursor;
+}
+
+// Devuelve los huecos que ya han dejado atrás todos los consumidores
+static void fifo_bcast_reclaim(fifo_t *fifo)
+{
+    u64 tail = fifo->bc_head + size_cbuffer_t(fifo->cbuffer);
+    u64 slowest = tail;
+    fifo_file_t *ff;
+
+    list_for_each_entry(ff, &fifo->readers, readers)
+        slowest = min(slowest, ff->cursor);
+
+    if (slowest == fifo->bc_head)
+        return;
+
+    fifo_lock_side(fifo, FIFO_READING);
+    skip_items_cbuffer_t(fifo->cbuffer, slowest - fifo->bc_head);
+    fifo_unlock_side(fifo, FIFO_READING);
+    fifo->bc_head = slowest;
+
+    fifo_wake_prod(fifo);
+}
+
+// Se llama con el mutex cogido y lo suelta
+static ssize_t fifo_read_bcast(fifo_t *fifo, fifo_file_t *ff,
+                                const struct iovec *iov, size_t length,
+                                int nonblock)
+{
+    int needed, copied;
+    u64 start;
+
+    // Cada uno tiene su cursor: el presupuesto de los despertares no sirve
+    // y se espera con 0 (se despierta a todos los que haya)
+    while (fifo_bcast_avail(fifo, ff) <
+            (needed = fifo_read_needed(fifo, length)) &&
+            fifo->num_prod > 0){
+        if (nonblock){
+            if (fifo_bcast_avail(fifo, ff) == 0){
+                up(&fifo->mutex);
+                return -EAGAIN;
+            }
+            break;
         }
+
+        if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons, 0))
+            return -EINTR;
     }
 
-    remove_items_cbuffer_t(cbuffer, kbuff, length); 
-    
-    // Broadcast a todos los productores, hay nuevos huecos
-    while(num_bloq_prod){
-        cond_signal(&cola_prod);
-        num_bloq_prod--;
+    needed = min_t(u64, length, fifo_bcast_avail(fifo, ff));
+    if (needed == 0){
+        up(&fifo->mutex);
+        return 0;
     }
 
-    up(&mutex);
-    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+    fifo_lock_side(fifo, FIFO_READING);
+    start = local_clock();
+    copied = fifo_peek_iov(fifo->cbuffer, iov, 0, ff->cursor - fifo->bc_head,
+                            needed);
+    fifo_lat_add(fifo, copy, start);
+    fifo_unlock_side(fifo, FIFO_READING);
 
-    length -= copy_to_user(buff, kbuff, length);
-    
-    DBGV("[TERMINADO] escritores esperando %d", num_bloq_prod);
+    ff->cursor += copied;
+    fifo_bcast_reclaim(fifo);
 
-    vfree(kbuff);
-    return length;
+    up(&fifo->mutex);
+
+    return copied ? copied : -EFAULT;
 }
 
 
-static ssize_t fifo_write (struct file *filp, 
-                            const char __user *buff, 
-                            size_t length, 
-                            loff_t *offset)
+static int Major;  
+
+static struct file_operations fops = {
+    .read = fifo_read,
+    .write = fifo_write,
+    .aio_read = fifo_aio_read,
+    .aio_write = fifo_aio_write,
+    .open = fifo_open,
+    .release = fifo_release,
+    .poll = fifo_poll,
+    .splice_read = fifo_splice_read,
+    .splice_write = fifo_splice_write,
+    .unlocked_ioctl = fifo_ioctl,
+    .mmap = fifo_mmap
+};
+
+
+static void destroy_fifos(unsigned int count)
 {
+    unsigned int i;
+
+    for (i = 0; i < count; i++){
+        hrtimer_cancel(&fifos[i].flush_timer);
+        destroy_cbuffer_t(fifos[i].cbuffer);
+        destroy_cbuffer_t(fifos[i].prio);
+        free_percpu(fifos[i].stats);
+        free_percpu(fifos[i].lat);
+    }
+
+    vfree(fifos);
+}
 
-    char *kbuff;
+int init_module(void)
+{
+    unsigned int i;
 
-    DBGV("Quiero escribir %d bytes", length);
+    if (nr_fifos == 0 || nr_fifos > MINORMASK + 1){
+        printk(KERN_ALERT "nr_fifos debe estar entre 1 y %d\n", MINORMASK + 1);
+        return -EINVAL;
+    }
 
-    if (length > BUF_LEN){
-        DBG("[ERROR] Demasiado para escribir");
+    if (fifo_size == 0 || fifo_size > FIFO_SIZE_LIMIT){
+        printk(KERN_ALERT "fifo_size debe estar entre 1 y %d\n", FIFO_SIZE_LIMIT);
         return -EINVAL;
     }
 
-    if((kbuff = vmalloc(length)) == NULL){
-        DBG("[ERROR] no se ha podido alojar memoria dinámica");
+    if((fifos = vmalloc(nr_fifos * sizeof(fifo_t))) == NULL)
         return -ENOMEM;
-    }
 
-    length -= copy_from_user(kbuff, buff, length);
+    for (i = 0; i < nr_fifos; i++){
+        fifo_t *fifo = &fifos[i];
 
-    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
-    if (down_interruptible(&mutex)){
-        DBGV("[INT] Interrumpido al intentar acceder a la SC");
-        vfree(kbuff);
-        return -EINTR;
+        fifo->minor = i;
+        hrtimer_init(&fifo->flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        fifo->flush_timer.function = fifo_flush_timer;
+        if((fifo->cbuffer = create_cbuffer_t(fifo_size)) == NULL){
+            destroy_fifos(i);
+            return -ENOMEM;
+        }
+
+        if((fifo->prio = create_cbuffer_t(FIFO_PRIO_SIZE)) == NULL){
+            destroy_cbuffer_t(fifo->cbuffer);
+            destroy_fifos(i);
+            return -ENOMEM;
+        }
+
+        fifo->stats = alloc_percpu(struct fifo_stats);
+        fifo->lat = alloc_percpu(struct fifo_latency);
+        if(fifo->stats == NULL || fifo->lat == NULL){
+            free_percpu(fifo->stats);
+            free_percpu(fifo->lat);
+            destroy_cbuffer_t(fifo->cbuffer);
+            destroy_cbuffer_t(fifo->prio);
+            destroy_fifos(i);
+            return -ENOMEM;
+        }
+
+        fifo->num_prod = 0;
+        fifo->num_cons = 0;
+        fifo->num_bloq_prod = 0;
+        fifo->num_bloq_cons = 0;
+        fifo->w_counter = 0;
+        fifo->busy = 0;
+        fifo->spsc = 0;
+        fifo->mode = 0;
+        fifo->lowat = 1;
+        fifo->policy = FIFO_POLICY_BLOCK;
+        fifo->ttl = 0;
+        fifo->bc_head = 0;
+        INIT_LIST_HEAD(&fifo->readers);
+        INIT_LIST_HEAD(&fifo->grp_queue);
+        fifo->rd_wmark = 1;
+        fifo->wr_wmark = 1;
+        fifo->flush_ns = 0;
+        atomic_set(&fifo->mapped, 0);
+        spin_lock_init(&fifo->map_lock);
+        fifo->map_blocked = 0;
+
+        sema_init(&fifo->mutex, 1);
+        init_waitqueue_head(&fifo->cola_cons);
+        init_waitqueue_head(&fifo->cola_prod);
+        init_waitqueue_head(&fifo->cola_prio);
+        init_waitqueue_head(&fifo->cola_poll);
     }
 
-    // Si escribe sin consumiedores -> Error
-    if (num_cons == 0){
-        up(&mutex);
-        DBG("[ERROR] Escritura sin consumidor");
-        vfree(kbuff);
-        return -EPIPE;
+    if (fifo_proc_init(fifos, nr_fifos)){
+        destroy_fifos(nr_fifos);
+        return -ENOMEM;
     }
 
-    // El productor se bloquea si no hay espacio
-    while (num_cons > 0 && nr_gaps_cbuffer_t(cbuffer) < length)
-        cond_wait(&mutex, &cola_prod, num_bloq_prod,
-                __InterruptHandler__ {
-                    vfree(kbuff);
-                });
+    // register_chrdev solo reserva los minors 0..255: se piden todos
+    Major = __register_chrdev(0, 0, nr_fifos, DEVICE_NAME, &fops);
 
-    // Comprobamos que al salir de un posible wait sigue habiendo consumidores.
-    if (num_cons == 0){
-        up(&mutex);
-	DBG("[ERROR] Escritura sin consumidor.");
-	vfree(kbuff);
-	return -EPIPE;
+    if (Major < 0) {
+        printk(KERN_ALERT "Registering char device failed with %d\n", Major);
+        fifo_proc_exit(nr_fifos);
+        destroy_fifos(nr_fifos);
+        return Major;
     }
-    
-    insert_items_cbuffer_t(cbuffer, kbuff, length); 
-    
-    // Broadcast a todos los consumidores, ya hay algo.
-    while(num_bloq_cons){
-        cond_signal(&cola_cons);
-        num_bloq_cons--;
+
+    DBG("I was assigned major number %d. To talk to\n", Major);
+    DBG("the driver, create a dev file with\n");
+    DBG("'mknod /var/tmp/fifo -m 666 c %d 0'.\n", Major);
+    DBG("Minors 0..%u are independent FIFOs.\n", nr_fifos - 1);
+    DBG("Remove the device file and module when done.\n");
+
+    return 0;
+}
+
+void cleanup_module(void)
+{
+    __unregister_chrdev(Major, 0, nr_fifos, DEVICE_NAME);
+    fifo_proc_exit(nr_fifos);
+    destroy_fifos(nr_fifos);
+}
+
+
+
+/*
+ *  Suelta los extremos de un fichero (se llama con el mutex cogido) y
+ *  despierta a quien tenga que enterarse.
+ */
+static void fifo_put_ends(fifo_t *fifo, fifo_file_t *ff,
+                            int is_cons, int is_prod)
+{
+    if (is_cons){
+        // Lo que solo faltaba por leer a este consumidor ya sobra
+        list_del(&ff->readers);
+        if (fifo->mode & FIFO_MODE_BROADCAST)
+            fifo_bcast_reclaim(fifo);
+        fifo->num_cons--;
+	if(fifo->num_cons == 0){ // Por si hay productores durmiendo, levántalos.
+            fifo_wake_all(fifo, &fifo->cola_prod);
+            fifo_wake_all(fifo, &fifo->cola_prio);
+        }
     }
 
-    up(&mutex);
-    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-    
-    DBGV("[TERMINADO] lectores esperando %d", num_bloq_cons);
+    if (is_prod){
+        fifo->num_prod--;
+	if(fifo->num_prod == 0) // Los consumidores dormidos tienen que ver el EOF
+            fifo_wake_all(fifo, &fifo->cola_cons);
+    }
 
-    vfree(kbuff);
-    return length;
+    // El registrador guarda lo último para quien se enganche después
+    if( !(fifo->num_prod || fifo->num_cons) &&
+            !(fifo->mode & FIFO_MODE_RECORDER) ){
+        clear_cbuffer_t(fifo->cbuffer);
+        clear_cbuffer_t(fifo->prio);
+    }
+
+    fifo_update_spsc(fifo);
+}
+
+
+// Contrapartida de fifo_put_ends, con el mutex cogido
+static void fifo_get_ends(fifo_t *fifo, fifo_file_t *ff,
+                            int is_cons, int is_prod)
+{
+    if (is_cons){
+        // Eres consumidor. En difusión se empieza por lo que llegue ahora.
+        fifo->num_cons++;
+        ff->cursor = fifo->bc_head + size_cbuffer_t(fifo->cbuffer);
+        list_add_tail(&ff->readers, &fifo->readers);
+        ff->lost = fifo->lost;
+        // Como en un pipe: si aún no hay productores, POLLHUP no se da hasta
+        // que se haya conectado alguno
+        ff->w_counter = fifo->w_counter - (fifo->num_prod != 0);
+        fifo_wake_all(fifo, &fifo->cola_prod);
+    }
+
+    if (is_prod){
+        // Eres un productor.
+        fifo->num_prod++;
+        fifo->w_counter++;
+        fifo_wake_all(fifo, &fifo->cola_cons);
+    }
+
+    fifo_update_spsc(fifo);
+    trace_fifo_open(fifo, is_cons, is_prod);
+}
+
+// Estado inicial de una apertura
+static void fifo_init_file(fifo_file_t *ff, fifo_t *fifo, fmode_t mode)
+{
+    ff->fifo = fifo;
+    ff->mode = mode;
+    ff->cursor = 0;
+    INIT_LIST_HEAD(&ff->readers);
+    ff->prio = 0;
+    ff->lost = 0;
+    ff->w_counter = 0;
+}
+
+static int fifo_open(struct inode *inode, struct file *file)
+{
+    char is_cons = (file->f_mode & FMODE_READ) != 0;
+    char is_prod = (file->f_mode & FMODE_WRITE) != 0;
+    unsigned int minor = iminor(inode);
+    fifo_file_t *ff;
+    fifo_t *fifo;
+
+    if (minor >= nr_fifos){
+        DBG("[ERROR] Minor %u fuera de rango", minor);
+        return -ENODEV;
+    }
+
+    if ((ff = kmalloc(sizeof(*ff), GFP_KERNEL)) == NULL)
+        return -ENOMEM;
+
+    fifo = &fifos[minor];
+    fifo_init_file(ff, fifo, file->f_mode);
+    file->private_data = ff;
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (down_interruptible(&fifo->mutex)){
+        kfree(ff);
+        return -EINTR;
+    }
+
+    // Como en un FIFO de Linux, O_RDWR cuenta como los dos extremos (y así
+    // nunca espera): es como se abre para mapear el anillo compartido.
+    fifo_get_ends(fifo, ff, is_cons, is_prod);
+        
+    // Al registrador se escribe y se lee sin esperar al otro extremo
+    if (!(file->f_flags & O_NONBLOCK) && !(fifo->mode & FIFO_MODE_RECORDER)){
+        while(is_cons && !fifo->num_prod)
+            if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons, 0))
+                goto interrupted;
+
+        while(is_prod && !fifo->num_cons)
+            if (cond_wait(fifo, &fifo->cola_prod, &fifo->num_bloq_prod, 0))
+                goto interrupted;
+    }
+
+    up(&fifo->mutex);
+        
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+    try_module_get(THIS_MODULE);
+
+    return 0;
+
+interrupted:
+    down(&fifo->mutex);
+    fifo_put_ends(fifo, ff, is_cons, is_prod);
+    up(&fifo->mutex);
+    kfree(ff);
+    return -EINTR;
+}
+
+
+static int fifo_release(struct inode *inode, struct file *file)
+{
+    fifo_file_t *ff = file->private_data;
+    fifo_t *fifo = ff->fifo;
+    
+    // INCIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    // El VFS ignora lo que devuelve release, así que no se puede interrumpir
+    down(&fifo->mutex);
+
+    fifo_put_ends(fifo, ff, file->f_mode & FMODE_READ,
+                    file->f_mode & FMODE_WRITE);
+    trace_fifo_release(fifo, (file->f_mode & FMODE_READ) != 0,
+                        (file->f_mode & FMODE_WRITE) != 0);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    kfree(ff);
+
+    module_put(THIS_MODULE);
+
+    return 0;
+}
+
+
+
+/*
+ *  Modo paquete: en el buffer cada mensaje va precedido de un fifo_msg (ver
+ *  fifo.h). Todo pasa con el mutex cogido (no hay camino rápido, ni mmap, ni
+ *  splice), así que un mensaje nunca se ve a medias. Las dos funciones se
+ *  llaman con el mutex cogido y lo sueltan.
+ */
+
+// Tira los mensajes caducados del principio de cb (solo con ttl)
+static void fifo_expire_msgs(fifo_t *fifo, cbuffer_t *cb)
+{
+    struct fifo_msg m;
+    int dropped = 0;
+
+    if (!fifo->ttl)
+        return;
+
+    while (!is_empty_cbuffer_t(cb)){
+        peek_items_cbuffer_t(cb, (char *)&m, sizeof(m));
+        if ((u32)jiffies - m.stamp <= fifo->ttl)
+            break;
+        skip_items_cbuffer_t(cb, sizeof(m) + m.hdr.len);
+        dropped += m.hdr.len;
+    }
+
+    if (dropped){
+        fifo_stat_add(fifo, expired, dropped);
+        if (cb == fifo->prio)
+            fifo_wake_prio(fifo);
+        else
+            fifo_wake_prod(fifo);
+    }
+}
+
+// Carril del que sale el siguiente mensaje (primero el prioritario)
+static cbuffer_t *fifo_msg_lane(fifo_t *fifo)
+{
+    fifo_expire_msgs(fifo, fifo->prio);
+    if (!is_empty_cbuffer_t(fifo->prio))
+        return fifo->prio;
+    fifo_expire_msgs(fifo, fifo->cbuffer);
+    if (!is_empty_cbuffer_t(fifo->cbuffer))
+        return fifo->cbuffer;
+    return NULL;
+}
+
+/*
+ *  Grupo de consumidores: cada lectura que entra pone su turno (un nodo en
+ *  su pila, así que varios hilos con el mismo descriptor no se pisan) a la
+ *  cola de grp_queue y solo el primero puede sacar mensajes: un turno por
+ *  orden de llegada, sin mirar cuánto trabajo tiene cada uno. Como cada uno
+ *  necesita ver si le toca, se duerme con presupuesto 0 y se despierta a
+ *  todos.
+ */
+static int fifo_grp_turn(fifo_t *fifo, struct list_head *turn)
+{
+    if (!(fifo->mode & FIFO_MODE_GROUP) || list_empty(&fifo->grp_queue))
+        return 1;
+    return fifo->grp_queue.next == turn;
+}
+
+// Sale de la cola (si estaba) y, si queda algo, le pasa el turno al siguiente
+static void fifo_grp_leave(fifo_t *fifo, struct list_head *turn)
+{
+    if (list_empty(turn))
+        return;
+
+    list_del_init(turn);
+    if (!fifo_msg_lane(fifo))
+        return;
+    if (waitqueue_active(&fifo->cola_cons))
+        wake_up_interruptible_all(&fifo->cola_cons);
+    // Sin nadie en la cola, a quien hace poll ya le toca (ver fifo_poll)
+    if (list_empty(&fifo->grp_queue) && waitqueue_active(&fifo->cola_poll))
+        wake_up_interruptible_poll(&fifo->cola_poll, POLLIN | POLLRDNORM);
+}
+
+/*
+ *  Espera a que haya un mensaje (y sea su turno) o EOF. Devuelve 0 con el
+ *  mutex o un error sin él.
+ */
+static int fifo_wait_msg(fifo_t *fifo, struct list_head *turn, int nonblock)
+{
+    int group;
+
+    for (;;){
+        // El modo puede pasar a grupo mientras se duerme (set_mode despierta
+        // a todos): entonces se coge turno, o los del grupo no nos dejarían
+        group = fifo->mode & FIFO_MODE_GROUP;
+        if (group && list_empty(turn))
+            list_add_tail(turn, &fifo->grp_queue);
+
+        if ((fifo_msg_lane(fifo) && fifo_grp_turn(fifo, turn)) ||
+                fifo->num_prod == 0)
+            return 0;
+
+        if (nonblock){
+            fifo_grp_leave(fifo, turn);
+            up(&fifo->mutex);
+            return -EAGAIN;
+        }
+        // No se sabe cuánto mide el siguiente: basta con el más corto
+        if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons,
+                        group ? 0 : FIFO_MSG_MIN)){
+            if (!list_empty(turn)){
+                down(&fifo->mutex);
+                fifo_grp_leave(fifo, turn);
+                up(&fifo->mutex);
+            }
+            return -EINTR;
+        }
+    }
+}
+
+// FIFO_POLICY_DROP_OLDEST: tira el mensaje más antiguo del buffer normal
+static void fifo_drop_msg(fifo_t *fifo)
+{
+    struct fifo_msg m;
+
+    peek_items_cbuffer_t(fifo->cbuffer, (char *)&m, sizeof(m));
+    skip_items_cbuffer_t(fifo->cbuffer, sizeof(m) + m.hdr.len);
+    fifo_stat_add(fifo, drop_old, m.hdr.len);
+    fifo->lost += m.hdr.len;
+}
+
+static ssize_t fifo_read_msgs(fifo_t *fifo, const struct iovec *iov,
+                                size_t length, int nonblock)
+{
+    LIST_HEAD(turn);
+    struct fifo_msg m;
+    cbuffer_t *cb;
+    int batch = fifo->mode & FIFO_MODE_BATCH;
+    int want, copied, msg, offset;
+    size_t done = 0;
+    ssize_t ret = 0;
+    u64 start;
+
+    if ((ret = fifo_wait_msg(fifo, &turn, nonblock)))
+        return ret;
+
+    fifo_lock_side(fifo, FIFO_READING);
+    start = local_clock();
+    while ((cb = fifo_msg_lane(fifo)) != NULL){
+        peek_items_cbuffer_t(cb, (char *)&m, sizeof(m));
+        msg = sizeof(m.hdr) + m.hdr.len;
+
+        if (batch){
+            // Solo mensajes enteros, y con su cabecera
+            if (msg > length - done){
+                if (done == 0)
+                    ret = -EMSGSIZE;
+                break;
+            }
+            offset = sizeof(m.stamp);
+            want = msg;
+        }else{
+            offset = sizeof(m);
+            want = min_t(size_t, m.hdr.len, length);
+        }
+
+        // Se copia sin sacarlo: si falla la copia, el mensaje se queda
+        copied = fifo_peek_iov(cb, iov, done, offset, want);
+        if (copied < want){
+            ret = -EFAULT;
+            break;
+        }
+        // Lo que no se entrega de un mensaje truncado se tira
+        skip_items_cbuffer_t(cb, sizeof(m) + m.hdr.len);
+        done += copied;
+
+        if (!batch)
+            break;
+    }
+    fifo_lat_add(fifo, copy, start);
+    fifo_unlock_side(fifo, FIFO_READING);
+
+    fifo_grp_leave(fifo, &turn);
+    fifo_wake_prod(fifo);
+    fifo_wake_prio(fifo);
+
+    up(&fifo->mutex);
+
+    return done ? done : ret;
+}
+
+static ssize_t fifo_write_msg(fifo_t *fifo, const struct iovec *iov,
+                                size_t length, int nonblock)
+{
+    struct fifo_msg m = { .hdr.len = length };
+    int copied, msg = sizeof(m) + length;
+    ssize_t ret;
+    u64 start;
+
+    for (;;){
+        if (fifo_no_readers(fifo)){
+            ret = -EPIPE;
+            goto out;
+        }
+        // Los mensajes no se trocean: tiene que caber entero
+        if (length > FIFO_SIZE_LIMIT || msg > fifo->cbuffer->max_size){
+            ret = -EMSGSIZE;
+            goto out;
+        }
+        if (nr_gaps_cbuffer_t(fifo->cbuffer) >= msg)
+            break;
+        // Lo caducado deja sitio antes de aplicar la política
+        fifo_expire_msgs(fifo, fifo->cbuffer);
+        if (nr_gaps_cbuffer_t(fifo->cbuffer) >= msg)
+            break;
+        if (fifo_drops_oldest(fifo)){
+            fifo_drop_msg(fifo);
+            continue;
+        }
+        if (fifo->policy == FIFO_POLICY_DROP_NEWEST){
+            fifo_stat_add(fifo, drop_new, length);
+            ret = length;
+            goto out;
+        }
+        if (nonblock){
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (cond_wait(fifo, &fifo->cola_prod, &fifo->num_bloq_prod, msg))
+            return -EINTR;
+    }
+
+    fifo_lock_side(fifo, FIFO_WRITING);
+    start = local_clock();
+    m.stamp = jiffies;
+    insert_items_cbuffer_t(fifo->cbuffer, (char *)&m, sizeof(m));
+    copied = fifo_insert_iov(fifo->cbuffer, iov, 0, length);
+    fifo_lat_add(fifo, copy, start);
+    if (copied < (int)length){
+        // Un mensaje a medias no puede quedarse en el buffer
+        unwind_items_cbuffer_t(fifo->cbuffer, sizeof(m) + copied);
+        ret = -EFAULT;
+    }else{
+        ret = length;
+    }
+    fifo_unlock_side(fifo, FIFO_WRITING);
+
+    if (ret > 0){
+        fifo_stat_high_water(fifo);
+        fifo_wake_cons(fifo);
+    }
+
+out:
+    up(&fifo->mutex);
+    return ret;
+}
+
+
+// FIFO_POLICY_DROP_OLDEST en bytes: tira del principio hasta que haya room huecos
+static void fifo_drop_oldest(fifo_t *fifo, int room)
+{
+    int drop;
+
+    // Con el bit cogido no hay nadie leyendo por el camino rápido
+    fifo_lock_side(fifo, FIFO_READING);
+    drop = room - nr_gaps_cbuffer_t(fifo->cbuffer);
+    if (drop > 0){
+        skip_items_cbuffer_t(fifo->cbuffer, drop);
+        fifo_stat_add(fifo, drop_old, drop);
+        fifo->lost += drop;
+    }
+    fifo_unlock_side(fifo, FIFO_READING);
+}
+
+
+// Lo mismo en el carril prioritario, donde no hay camino rápido
+static void fifo_drop_prio(fifo_t *fifo, int packet, int room)
+{
+    struct fifo_msg m;
+    int drop;
+
+    if (packet){
+        peek_items_cbuffer_t(fifo->prio, (char *)&m, sizeof(m));
+        skip_items_cbuffer_t(fifo->prio, sizeof(m) + m.hdr.len);
+        drop = m.hdr.len;
+    }else{
+        drop = room - nr_gaps_cbuffer_t(fifo->prio);
+        skip_items_cbuffer_t(fifo->prio, drop);
+    }
+
+    fifo_stat_add(fifo, drop_old, drop);
+    fifo->lost += drop;
+}
+
+
+/*
+ *  Escritura en el carril prioritario: atómica, y en modo paquete como un
+ *  mensaje. Se llama con el mutex cogido y lo suelta.
+ */
+static ssize_t fifo_write_prio(fifo_t *fifo, const struct iovec *iov,
+                                size_t length, int nonblock)
+{
+    struct fifo_msg m = { .hdr.len = length };
+    int packet = fifo->mode & FIFO_MODE_PACKET;
+    int copied, msg = (packet ? sizeof(m) : 0) + length;
+    ssize_t ret;
+
+    for (;;){
+        if (fifo_no_readers(fifo)){
+            ret = -EPIPE;
+            goto out;
+        }
+        if (fifo->mode & FIFO_MODE_BROADCAST){
+            ret = -EINVAL;
+            goto out;
+        }
+        if (length > FIFO_PRIO_SIZE || msg > fifo->prio->max_size){
+            ret = -EMSGSIZE;
+            goto out;
+        }
+        if (nr_gaps_cbuffer_t(fifo->prio) >= msg)
+            break;
+        // Como en el buffer normal (el registrador nunca espera)
+        if (fifo_drops_oldest(fifo)){
+            fifo_drop_prio(fifo, packet, msg);
+            continue;
+        }
+        if (nonblock){
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (cond_wait(fifo, &fifo->cola_prio, &fifo->num_bloq_prod, msg))
+            return -EINTR;
+    }
+
+    if (packet){
+        m.stamp = jiffies;
+        insert_items_cbuffer_t(fifo->prio, (char *)&m, sizeof(m));
+    }
+    copied = fifo_insert_iov(fifo->prio, iov, 0, length);
+    if (copied < (int)length){
+        unwind_items_cbuffer_t(fifo->prio, msg - length + copied);
+        ret = -EFAULT;
+        goto out;
+    }
+    ret = length;
+
+    wake_up_interruptible_all(&fifo->cola_cons);
+    if (waitqueue_active(&fifo->cola_poll))
+        wake_up_interruptible_poll(&fifo->cola_poll, POLLIN | POLLRDNORM | POLLPRI);
+
+out:
+    up(&fifo->mutex);
+    return ret;
+}
+
+
+/*
+ *  Cuerpo de la lectura: length bytes repartidos en los segmentos de iov.
+ *  Como en fifo_do_write, pueden ser memoria del kernel con set_fs(KERNEL_DS).
+ */
+static ssize_t fifo_do_read (fifo_file_t *ff,
+                            const struct iovec *iov,
+                            size_t length,	
+                            int nonblock)
+{
+    fifo_t *fifo = ff->fifo;
+    int needed, copied;
+    u64 start;
+
+    if (length == 0)
+        return 0;
+
+    // Un productor y un consumidor: sin mutex mientras no haya que esperar
+    if ((copied = fifo_fast_read(fifo, iov, length)) != 0)
+        return copied;
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (fifo_lock(fifo))
+        return -EINTR;
+
+    if (fifo->mode & FIFO_MODE_PACKET)
+        return fifo_read_msgs(fifo, iov, length, nonblock);
+
+    if (fifo->mode & FIFO_MODE_BROADCAST)
+        return fifo_read_bcast(fifo, ff, iov, length, nonblock);
+
+    // El consumidor se bloquea si no tiene lo que pide (o lowat, en lectura
+    // parcial) y aún hay productores. Nunca se puede esperar a más de lo que
+    // cabe en el buffer (que puede cambiar de tamaño mientras dormimos).
+    while (size_cbuffer_t(fifo->cbuffer) <
+            (needed = fifo_read_needed(fifo, length)) &&
+            is_empty_cbuffer_t(fifo->prio) && fifo->num_prod > 0){
+        // Sin bloqueo se entrega lo que haya, y si no hay nada -EAGAIN
+        if (nonblock){
+            if (is_empty_cbuffer_t(fifo->cbuffer)){
+                up(&fifo->mutex);
+                return -EAGAIN;
+            }
+            break;
+        }
+
+        if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons, needed))
+            return -EINTR;
+    }
+
+    // Lo prioritario se entrega antes y sin mezclarlo con lo normal
+    if (!is_empty_cbuffer_t(fifo->prio)){
+        needed = min_t(size_t, length, size_cbuffer_t(fifo->prio));
+        copied = fifo_remove_iov(fifo->prio, iov, 0, needed);
+        fifo_wake_prio(fifo);
+        up(&fifo->mutex);
+        return copied ? copied : -EFAULT;
+    }
+
+    // Si el pipe esta vacio y no hay productores -> EOF
+    if (is_empty_cbuffer_t(fifo->cbuffer)){
+        up(&fifo->mutex);
+        return 0;
+    }
+
+    // Sin productores (o sin bloqueo, o en lectura parcial) se entrega lo
+    // que haya aunque no llegue a lo pedido
+    needed = min_t(size_t, length, size_cbuffer_t(fifo->cbuffer));
+
+    // Copia directa del buffer circular al usuario, sin buffer intermedio
+    fifo_lock_side(fifo, FIFO_READING);
+    start = local_clock();
+    copied = fifo_remove_iov(fifo->cbuffer, iov, 0, needed);
+    fifo_lat_add(fifo, copy, start);
+    fifo_unlock_side(fifo, FIFO_READING);
+    
+    // Despierta solo a los productores que caben en los nuevos huecos
+    fifo_wake_prod(fifo);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    if (copied == 0)
+        return -EFAULT;
+
+    return copied;
+}
+
+
+static ssize_t fifo_read (struct file *filp,
+                            char __user *buff,
+                            size_t length,
+                            loff_t *offset)
+{
+    fifo_t *fifo = fifo_of(filp);
+    struct iovec iov = { .iov_base = buff, .iov_len = length };
+    ssize_t ret;
+
+    trace_fifo_read_enter(fifo, length);
+    ret = fifo_do_read(filp->private_data, &iov, length,
+                        filp->f_flags & O_NONBLOCK);
+    fifo_account(fifo, ret, 0);
+    trace_fifo_read_exit(fifo, ret);
+
+    return ret;
+}
+
+
+/*
+ *  Cuerpo de la escritura: length bytes repartidos en los segmentos de iov,
+ *  que cuentan como una sola escritura (atómica si cabe en PIPE_BUF). Pueden
+ *  ser memoria del kernel si quien llama ha hecho set_fs(KERNEL_DS) (splice).
+ */
+static ssize_t fifo_do_write (fifo_t *fifo,
+                            const struct iovec *iov,
+                            size_t length, 
+                            int nonblock,
+                            int prio)
+{
+    int atomic, needed, chunk, copied;
+    size_t written = 0;
+    ssize_t ret = 0;
+    u64 start;
+
+    if (length == 0)
+        return 0;
+
+    // Un productor y un consumidor: sin mutex mientras no haya que esperar
+    if (!prio && (ret = fifo_fast_write(fifo, iov, length)) != 0)
+        return ret;
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (fifo_lock(fifo))
+        return -EINTR;
+
+    if (prio)
+        return fifo_write_prio(fifo, iov, length, nonblock);
+
+    if (fifo->mode & FIFO_MODE_PACKET)
+        return fifo_write_msg(fifo, iov, length, nonblock);
+
+    atomic = length <= fifo_atomic_len(fifo);
+
+    while (written < length){
+        // Si escribe sin consumiedores -> Error (o lo que llevemos escrito)
+        if (fifo_no_readers(fifo)){
+            ret = -EPIPE;
+            break;
+        }
+
+        // En el registrador, de lo que no cabe ni con el buffer vacío solo
+        // se guarda el final: el principio se da por perdido sin copiarlo
+        if ((fifo->mode & FIFO_MODE_RECORDER) &&
+                length - written > fifo->cbuffer->max_size){
+            chunk = length - written - fifo->cbuffer->max_size;
+            fifo_stat_add(fifo, drop_old, chunk);
+            fifo->lost += chunk;
+            written += chunk;
+        }
+
+        // Una escritura atómica espera a que quepa entera, una grande a
+        // que haya algún hueco para el siguiente trozo. Si el buffer
+        // encoge por debajo de una atómica, pasa a ir por trozos.
+        needed = (atomic && length <= fifo->cbuffer->max_size) ? length : 1;
+
+        // Sin esperar: se hace sitio para todo lo que quede (o lo que quepa)
+        if (fifo_drops_oldest(fifo))
+            fifo_drop_oldest(fifo, min_t(size_t, length - written,
+                                            fifo->cbuffer->max_size));
+
+        if (nr_gaps_cbuffer_t(fifo->cbuffer) < needed){
+            // Lo que no cabe se tira y para el productor queda escrito
+            if (fifo->policy == FIFO_POLICY_DROP_NEWEST){
+                fifo_stat_add(fifo, drop_new, length - written);
+                written = length;
+                break;
+            }
+            if (nonblock){
+                ret = -EAGAIN;
+                break;
+            }
+            if (cond_wait(fifo, &fifo->cola_prod, &fifo->num_bloq_prod, needed))
+                return written ? written : -EINTR;
+            continue;
+        }
+
+        chunk = min_t(size_t, length - written, nr_gaps_cbuffer_t(fifo->cbuffer));
+
+        // Copia directa del usuario al buffer circular, sin buffer intermedio
+        fifo_lock_side(fifo, FIFO_WRITING);
+        start = local_clock();
+        copied = fifo_insert_iov(fifo->cbuffer, iov, written, chunk);
+        fifo_lat_add(fifo, copy, start);
+        fifo_unlock_side(fifo, FIFO_WRITING);
+        fifo_stat_high_water(fifo);
+        written += copied;
+
+        // Despierta solo a los consumidores que ya tienen lo que piden
+        fifo_wake_cons(fifo);
+
+        if (copied < chunk){
+            ret = -EFAULT;
+            break;
+        }
+    }
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+    
+    return written ? written : ret;
+}
+
+
+static ssize_t fifo_write (struct file *filp,
+                            const char __user *buff,
+                            size_t length,
+                            loff_t *offset)
+{
+    fifo_t *fifo = fifo_of(filp);
+    struct iovec iov = { .iov_base = (void __user *)buff, .iov_len = length };
+    ssize_t ret;
+
+    trace_fifo_write_enter(fifo, length);
+    ret = fifo_do_write(fifo, &iov, length, filp->f_flags & O_NONBLOCK,
+                        ((fifo_file_t *)filp->private_data)->prio);
+    fifo_account(fifo, ret, 1);
+    trace_fifo_write_exit(fifo, ret);
+
+    return ret;
+}
+
+
+/*
+ *  readv/writev: todos los segmentos se mueven con una sola entrada en la
+ *  sección crítica. El VFS ya ha comprobado el vector (rw_copy_check_uvector).
+ *  Como en un pipe, el FIFO no tiene posición y pos se ignora.
+ */
+static ssize_t fifo_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                                unsigned long nr_segs, loff_t pos)
+{
+    struct file *filp = iocb->ki_filp;
+    fifo_t *fifo = fifo_of(filp);
+    size_t length = iov_length(iov, nr_segs);
+    ssize_t ret;
+
+    trace_fifo_read_enter(fifo, length);
+    ret = fifo_do_read(filp->private_data, iov, length,
+                        filp->f_flags & O_NONBLOCK);
+    fifo_account(fifo, ret, 0);
+    trace_fifo_read_exit(fifo, ret);
+
+    return ret;
+}
+
+static ssize_t fifo_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                                unsigned long nr_segs, loff_t pos)
+{
+    struct file *filp = iocb->ki_filp;
+    fifo_t *fifo = fifo_of(filp);
+    size_t length = iov_length(iov, nr_segs);
+    ssize_t ret;
+
+    trace_fifo_write_enter(fifo, length);
+    ret = fifo_do_write(fifo, iov, length, filp->f_flags & O_NONBLOCK,
+                        ((fifo_file_t *)filp->private_data)->prio);
+    fifo_account(fifo, ret, 1);
+    trace_fifo_write_exit(fifo, ret);
+
+    return ret;
+}
+
+
+static unsigned int fifo_poll(struct file *filp, poll_table *wait)
+{
+    fifo_file_t *ff = filp->private_data;
+    fifo_t *fifo = ff->fifo;
+    unsigned int mask = 0;
+
+    poll_wait(filp, &fifo->cola_poll, wait);
+    // El camino rápido publica sin el mutex: ver fifo_wake_cons
+    smp_mb();
+
+    // Con el mutex la foto es coherente y no se pierde ningún despertar:
+    // quien cambie el buffer después nos verá ya en cola_poll, y un extremo
+    // mapeado verá en la cabecera que tiene que avisar (barrera completa
+    // antes de mirar el anillo)
+    down(&fifo->mutex);
+    fifo_update_waiters(fifo);
+
+    if (filp->f_mode & FMODE_READ){
+        // En grupo, con lecturas esperando turno el siguiente mensaje es
+        // suyo: un lector sin bloqueo solo recibiría -EAGAIN
+        int turn = !(fifo->mode & FIFO_MODE_GROUP) ||
+                    list_empty(&fifo->grp_queue);
+
+        if (fifo->mode & FIFO_MODE_BROADCAST){
+            if (fifo_bcast_avail(fifo, ff))
+                mask |= POLLIN | POLLRDNORM;
+        }else if (turn && !is_empty_cbuffer_t(fifo->cbuffer))
+            mask |= POLLIN | POLLRDNORM;
+        if (turn && !is_empty_cbuffer_t(fifo->prio))
+            mask |= POLLIN | POLLRDNORM | POLLPRI;
+        if (fifo->num_prod == 0 && ff->w_counter != fifo->w_counter)
+            mask |= POLLHUP;
+    }
+
+    if (filp->f_mode & FMODE_WRITE){
+        // Tirando datos no se espera nunca
+        if (nr_gaps_cbuffer_t(fifo->cbuffer) >= fifo_poll_space(fifo) ||
+                fifo->policy != FIFO_POLICY_BLOCK ||
+                (fifo->mode & FIFO_MODE_RECORDER))
+            mask |= POLLOUT | POLLWRNORM;
+        if (fifo_no_readers(fifo))
+            mask |= POLLERR;
+    }
+
+    up(&fifo->mutex);
+
+    return mask;
+}
+
+
+
+/*
+ *   Splice: de FIFO a pipe se copia del buffer circular a páginas que se
+ *   entregan al pipe; de pipe a FIFO se copia de las páginas del pipe al
+ *   buffer. Los datos nunca pasan por espacio de usuario.
+ */
+static void fifo_pipe_buf_release(struct pipe_inode_info *pipe,
+                                    struct pipe_buffer *buf)
+{
+    page_cache_release(buf->page);
+}
+
+static const struct pipe_buf_operations fifo_pipe_buf_ops = {
+    .can_merge = 0,
+    .map = generic_pipe_buf_map,
+    .unmap = generic_pipe_buf_unmap,
+    .confirm = generic_pipe_buf_confirm,
+    .release = fifo_pipe_buf_release,
+    .steal = generic_pipe_buf_steal,
+    .get = generic_pipe_buf_get,
+};
+
+/*
+ *  Huecos libres en el pipe, esperando (salvo nonblock) a que haya alguno.
+ *  Como splice_to_pipe, -EPIPE y SIGPIPE si no tiene lectores.
+ */
+static int fifo_pipe_space(struct pipe_inode_info *pipe, int nonblock)
+{
+    int free;
+
+    for (;;){
+        pipe_lock(pipe);
+        if (!pipe->readers){
+            pipe_unlock(pipe);
+            send_sig(SIGPIPE, current, 0);
+            return -EPIPE;
+        }
+        free = pipe->buffers - pipe->nrbufs;
+        pipe_unlock(pipe);
+
+        if (free > 0)
+            return free;
+        if (nonblock)
+            return -EAGAIN;
+        if (wait_event_interruptible(pipe->wait,
+                ACCESS_ONCE(pipe->nrbufs) < pipe->buffers ||
+                !ACCESS_ONCE(pipe->readers)))
+            return -ERESTARTSYS;
+    }
+}
+
+// Mete una página llena en el pipe, con su cerrojo cogido y sitio libre
+static void fifo_pipe_push(struct pipe_inode_info *pipe, struct page *page,
+                            unsigned int len)
+{
+    int newbuf = (pipe->curbuf + pipe->nrbufs) & (pipe->buffers - 1);
+    struct pipe_buffer *buf = pipe->bufs + newbuf;
+
+    buf->page = page;
+    buf->offset = 0;
+    buf->len = len;
+    buf->private = 0;
+    buf->flags = 0;
+    buf->ops = &fifo_pipe_buf_ops;
+    pipe->nrbufs++;
+}
+
+static ssize_t fifo_splice_read(struct file *in, loff_t *ppos,
+                                struct pipe_inode_info *pipe, size_t len,
+                                unsigned int flags)
+{
+    fifo_t *fifo = fifo_of(in);
+    struct page *pages[PIPE_DEF_BUFFERS];
+    int nonblock = (in->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+    int nr_pages, i = 0, chunk, free;
+    size_t copied = 0;
+    ssize_t ret;
+
+    // Fuera del mutex no se puede mirar el buffer (fifo_resize lo cambia)
+    len = min_t(size_t, len, PIPE_DEF_BUFFERS * PAGE_SIZE);
+    if (len == 0)
+        return 0;
+
+    // Las páginas se piden antes de entrar en ninguna sección crítica
+    nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+    for (i = 0; i < nr_pages; i++)
+        if ((pages[i] = alloc_page(GFP_KERNEL)) == NULL)
+            break;
+
+    if ((nr_pages = i) == 0){
+        fifo_account(fifo, -ENOMEM, 0);
+        return -ENOMEM;
+    }
+    len = min_t(size_t, len, nr_pages * PAGE_SIZE);
+    i = 0;
+
+    /*
+     *  Lo que el pipe no acepte se perdería, así que se saca del FIFO con el
+     *  cerrojo del pipe cogido (el orden es siempre pipe -> FIFO, ver
+     *  fifo_splice_write) y solo lo que cabe. Las esperas se hacen sin él,
+     *  y con los dos cerrojos se vuelve a mirar.
+     */
+    for (;;){
+        if ((ret = fifo_pipe_space(pipe, nonblock)) < 0)
+            goto out_free;
+
+        if (fifo_lock(fifo)){
+            ret = -EINTR;
+            goto out_free;
+        }
+
+        // Como un pipe: basta con que haya algo
+        while (is_empty_cbuffer_t(fifo->cbuffer) && fifo->num_prod > 0){
+            if (nonblock){
+                up(&fifo->mutex);
+                ret = -EAGAIN;
+                goto out_free;
+            }
+            if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons, 1)){
+                ret = -EINTR;
+                goto out_free;
+            }
+        }
+        up(&fifo->mutex);
+
+        pipe_lock(pipe);
+        if (!pipe->readers){
+            pipe_unlock(pipe);
+            send_sig(SIGPIPE, current, 0);
+            ret = -EPIPE;
+            goto out_free;
+        }
+        free = pipe->buffers - pipe->nrbufs;
+
+        // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+        if (fifo_lock(fifo)){
+            pipe_unlock(pipe);
+            ret = -EINTR;
+            goto out_free;
+        }
+        if (free > 0 && (!is_empty_cbuffer_t(fifo->cbuffer) ||
+                fifo->num_prod == 0))
+            break;
+        up(&fifo->mutex);
+        pipe_unlock(pipe);
+    }
+
+    // En un pipe se perderían los límites de los mensajes (o los cursores)
+    if (fifo->mode & (FIFO_MODE_PACKET | FIFO_MODE_BROADCAST)){
+        up(&fifo->mutex);
+        pipe_unlock(pipe);
+        ret = -EINVAL;
+        goto out_free;
+    }
+
+    // Vacío sin productores: no se copia nada (EOF)
+    len = min_t(size_t, len, free * PAGE_SIZE);
+    len = min_t(size_t, len, size_cbuffer_t(fifo->cbuffer));
+
+    fifo_lock_side(fifo, FIFO_READING);
+    for (; copied < len; i++){
+        chunk = min_t(size_t, len - copied, PAGE_SIZE);
+        remove_items_cbuffer_t(fifo->cbuffer, page_address(pages[i]), chunk);
+        fifo_pipe_push(pipe, pages[i], chunk);
+        copied += chunk;
+    }
+    fifo_unlock_side(fifo, FIFO_READING);
+
+    if (copied)
+        fifo_wake_prod(fifo);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+    pipe_unlock(pipe);
+
+    // Como splice_to_pipe: se avisa a los lectores del pipe ya sin cerrojo
+    if (copied){
+        smp_mb();
+        if (waitqueue_active(&pipe->wait))
+            wake_up_interruptible_sync(&pipe->wait);
+        kill_fasync(&pipe->fasync_readers, SIGIO, POLL_IN);
+    }
+    ret = copied;
+
+out_free:
+    // Las que se han metido en el pipe ya son suyas
+    while (nr_pages > i)
+        page_cache_release(pages[--nr_pages]);
+    fifo_account(fifo, ret, 0);
+    return ret;
+}
+
+static int pipe_to_fifo(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                        struct splice_desc *sd)
+{
+    struct file *out = sd->u.file;
+    int nonblock = (out->f_flags & O_NONBLOCK) || (sd->flags & SPLICE_F_NONBLOCK);
+    mm_segment_t old_fs;
+    struct iovec iov;
+    char *src;
+    int ret;
+
+    if ((ret = buf->ops->confirm(pipe, buf)))
+        return ret;
+
+    // Reutiliza la escritura normal pasándole la página del pipe
+    src = buf->ops->map(pipe, buf, 0);
+    iov.iov_base = (__force void __user *)src + buf->offset;
+    iov.iov_len = sd->len;
+    old_fs = get_fs();
+    set_fs(get_ds());
+    ret = fifo_do_write(fifo_of(out), &iov, sd->len, nonblock, 0);
+    set_fs(old_fs);
+    fifo_account(fifo_of(out), ret, 1);
+    buf->ops->unmap(pipe, buf, src);
+
+    return ret;
+}
+
+static ssize_t fifo_splice_write(struct pipe_inode_info *pipe, struct file *out,
+                                    loff_t *ppos, size_t len, unsigned int flags)
+{
+    fifo_t *fifo = fifo_of(out);
+
+    if (ACCESS_ONCE(fifo->mode) & FIFO_MODE_PACKET)
+        return -EINVAL;
+
+    return splice_from_pipe(pipe, out, ppos, len, flags, pipe_to_fifo);
+}
+
+
+
+/*
+ *  mmap se llama con mmap_sem cogido y las copias al usuario con el mutex
+ *  pueden fallar de página y pedir mmap_sem, así que fifo_mmap no puede
+ *  coger el mutex. Lo que necesita ver estable (mode, policy, cbuffer) lo
+ *  ordena map_lock: quien cambia algo que un mapeo no admite comprueba que
+ *  no hay mapeos y bloquea los nuevos hasta que termina.
+ */
+static int fifo_map_block(fifo_t *fifo)
+{
+    int ret = 0;
+
+    spin_lock(&fifo->map_lock);
+    if (atomic_read(&fifo->mapped))
+        ret = -EBUSY;
+    else
+        fifo->map_blocked++;
+    spin_unlock(&fifo->map_lock);
+
+    return ret;
+}
+
+static void fifo_map_unblock(fifo_t *fifo)
+{
+    spin_lock(&fifo->map_lock);
+    fifo->map_blocked--;
+    spin_unlock(&fifo->map_lock);
+}
+
+/*
+ *  Cambia la capacidad del FIFO conservando lo que haya en el buffer. Se
+ *  llama con el mutex cogido. Devuelve la nueva capacidad.
+ */
+static long fifo_resize(fifo_t *fifo, unsigned long size)
+{
+    cbuffer_t *cbuffer, *old;
+
+    if (size == 0 || size > FIFO_SIZE_LIMIT)
+        return -EINVAL;
+
+    if (size > fifo_max_size && !capable(CAP_SYS_RESOURCE))
+        return -EPERM;
+
+    if (size == fifo->cbuffer->max_size)
+        return size;
+
+    if ((cbuffer = create_cbuffer_t(size)) == NULL)
+        return -ENOMEM;
+
+    // Quien tenga el anillo mapeado se quedaría con el viejo
+    if (fifo_map_block(fifo)){
+        destroy_cbuffer_t(cbuffer);
+        return -EBUSY;
+    }
+
+    // Con los dos lados cogidos no hay nadie en el camino rápido
+    fifo_lock_side(fifo, FIFO_READING);
+    fifo_lock_side(fifo, FIFO_WRITING);
+
+    old = fifo->cbuffer;
+
+    // Como F_SETPIPE_SZ: no se tira nada de lo que ya está en el buffer
+    if (size < size_cbuffer_t(old)){
+        fifo_unlock_side(fifo, FIFO_WRITING);
+        fifo_unlock_side(fifo, FIFO_READING);
+        fifo_map_unblock(fifo);
+        destroy_cbuffer_t(cbuffer);
+        return -EBUSY;
+    }
+
+    transfer_cbuffer_t(cbuffer, old);
+    fifo->cbuffer = cbuffer;
+    fifo_update_waiters(fifo);
+
+    fifo_unlock_side(fifo, FIFO_WRITING);
+    fifo_unlock_side(fifo, FIFO_READING);
+    fifo_map_unblock(fifo);
+
+    // El temporizador y los tracepoints miran el buffer sin cerrojos (ver
+    // fifo_trace.h); ya solo pueden ver el nuevo
+    hrtimer_cancel(&fifo->flush_timer);
+    synchronize_sched();
+    destroy_cbuffer_t(old);
+
+    // Los que esperan tienen que recalcular lo que necesitan
+    fifo_wake_all(fifo, &fifo->cola_prod);
+    fifo_wake_all(fifo, &fifo->cola_cons);
+
+    return size;
+}
+
+
+/*
+ *   ioctl: estado y capacidad del FIFO y esperas/avisos para el anillo
+ *   compartido
+ */
+/*
+ *  FIFO_IOC_RECV_MSGS: varios mensajes con una sola entrada en la sección
+ *  crítica. La longitud de cada uno se escribe antes de sacarlo, así que si
+ *  falla esa copia el mensaje se queda en el buffer.
+ */
+static long fifo_recv_msgs(fifo_t *fifo, struct fifo_recv __user *arg,
+                            int nonblock)
+{
+    LIST_HEAD(turn);
+    struct fifo_recv req;
+    struct fifo_msg m;
+    struct iovec iov;
+    cbuffer_t *cb;
+    u32 __user *lens;
+    u32 n = 0;
+    size_t done = 0;
+    int copied;
+    long ret;
+    u64 start;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.max_msgs == 0)
+        return 0;
+
+    iov.iov_base = (void __user *)(unsigned long)req.buf;
+    iov.iov_len = req.buf_len;
+    lens = (u32 __user *)(unsigned long)req.lens;
+
+    trace_fifo_read_enter(fifo, req.buf_len);
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (fifo_lock(fifo)){
+        ret = -EINTR;
+        goto out;
+    }
+
+    if (!(fifo->mode & FIFO_MODE_PACKET)){
+        up(&fifo->mutex);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if ((ret = fifo_wait_msg(fifo, &turn, nonblock)))
+        goto out;
+
+    fifo_lock_side(fifo, FIFO_READING);
+    start = local_clock();
+    while (n < req.max_msgs && (cb = fifo_msg_lane(fifo)) != NULL){
+        peek_items_cbuffer_t(cb, (char *)&m, sizeof(m));
+
+        if (m.hdr.len > req.buf_len - done){
+            if (n == 0)
+                ret = -EMSGSIZE;
+            break;
+        }
+
+        if (put_user(m.hdr.len, lens + n)){
+            ret = -EFAULT;
+            break;
+        }
+
+        // Solo se saca del buffer si se ha podido copiar entero
+        copied = fifo_peek_iov(cb, &iov, done, sizeof(m), m.hdr.len);
+        if (copied < m.hdr.len){
+            ret = -EFAULT;
+            break;
+        }
+        skip_items_cbuffer_t(cb, sizeof(m) + m.hdr.len);
+
+        done += copied;
+        n++;
+    }
+    fifo_lat_add(fifo, copy, start);
+    fifo_unlock_side(fifo, FIFO_READING);
+
+    fifo_grp_leave(fifo, &turn);
+    fifo_wake_prod(fifo);
+    fifo_wake_prio(fifo);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    if (n){
+        ret = n;
+        if (put_user(n, &arg->nr_msgs))
+            ret = -EFAULT;
+    }
+
+out:
+    fifo_account(fifo, n ? done : ret, 0);
+    trace_fifo_read_exit(fifo, n ? done : ret);
+    return ret;
+}
+
+// FIFO_IOC_SET_WMARK, con el mutex cogido
+static long fifo_set_wmark(fifo_t *fifo, struct fifo_wmark *wm)
+{
+    if (wm->rd_wmark == 0 || wm->rd_wmark > FIFO_SIZE_LIMIT ||
+            wm->wr_wmark == 0 || wm->wr_wmark > FIFO_SIZE_LIMIT ||
+            wm->flush_us > FIFO_WMARK_MAX_FLUSH)
+        return -EINVAL;
+
+    fifo->rd_wmark = wm->rd_wmark;
+    fifo->wr_wmark = wm->wr_wmark;
+    fifo->flush_ns = (u64)wm->flush_us * NSEC_PER_USEC;
+
+    // Con marcas más bajas puede que alguien ya pueda avanzar
+    fifo_wake_cons(fifo);
+    fifo_wake_prod(fifo);
+
+    return 0;
+}
+
+// FIFO_IOC_SET_POLICY, con el mutex cogido
+static long fifo_set_policy(fifo_t *fifo, struct fifo_policy *pol)
+{
+    if (pol->policy > FIFO_POLICY_DROP_NEWEST ||
+            pol->ttl_ms > FIFO_POLICY_MAX_TTL)
+        return -EINVAL;
+
+    if (pol->policy == FIFO_POLICY_DROP_OLDEST &&
+            (fifo->mode & FIFO_MODE_BROADCAST))
+        return -EINVAL;
+
+    // Con el anillo mapeado head es del consumidor
+    spin_lock(&fifo->map_lock);
+    if (pol->policy != FIFO_POLICY_BLOCK && atomic_read(&fifo->mapped)){
+        spin_unlock(&fifo->map_lock);
+        return -EBUSY;
+    }
+    fifo->policy = pol->policy;
+    spin_unlock(&fifo->map_lock);
+
+    fifo->ttl = pol->ttl_ms ? max(msecs_to_jiffies(pol->ttl_ms), 1UL) : 0;
+
+    // Los productores dormidos ya no tienen por qué esperar
+    fifo_wake_all(fifo, &fifo->cola_prod);
+
+    return 0;
+}
+
+/*
+ *  Cambia el modo del FIFO. Se llama con el mutex cogido. Con los dos bits
+ *  cogidos no hay nadie en el camino rápido mientras cambia spsc.
+ */
+static long fifo_set_mode(fifo_t *fifo, unsigned long mode)
+{
+    int block;
+
+    if (mode & ~FIFO_MODES)
+        return -EINVAL;
+
+    if ((mode & FIFO_MODE_BATCH) && !(mode & FIFO_MODE_PACKET))
+        return -EINVAL;
+
+    if ((mode & FIFO_MODE_BROADCAST) && (mode & FIFO_MODE_PACKET))
+        return -EINVAL;
+
+    if ((mode & FIFO_MODE_GROUP) && !(mode & FIFO_MODE_PACKET))
+        return -EINVAL;
+
+    // Tirar lo más antiguo dejaría cursores apuntando a nada
+    if ((mode & FIFO_MODE_BROADCAST) &&
+            (fifo->policy == FIFO_POLICY_DROP_OLDEST ||
+                (mode & FIFO_MODE_RECORDER)))
+        return -EINVAL;
+
+    // Lo que haya en el buffer no se puede reinterpretar
+    if (((mode ^ fifo->mode) & (FIFO_MODE_PACKET | FIFO_MODE_BROADCAST)) &&
+            (!is_empty_cbuffer_t(fifo->cbuffer) ||
+                !is_empty_cbuffer_t(fifo->prio)))
+        return -EBUSY;
+
+    // Ni eso ni el registrador (head es del consumidor) admiten mapeos
+    block = ((mode ^ fifo->mode) & (FIFO_MODE_PACKET | FIFO_MODE_BROADCAST)) ||
+            ((mode & ~fifo->mode) & FIFO_MODE_RECORDER);
+    if (block && fifo_map_block(fifo))
+        return -EBUSY;
+
+    // Con el buffer vacío todos los cursores empiezan en head
+    if ((mode & ~fifo->mode) & FIFO_MODE_BROADCAST){
+        fifo_file_t *ff;
+
+        list_for_each_entry(ff, &fifo->readers, readers)
+            ff->cursor = fifo->bc_head;
+    }
+
+    fifo_lock_side(fifo, FIFO_READING);
+    fifo_lock_side(fifo, FIFO_WRITING);
+    fifo->mode = mode;
+    fifo_update_spsc(fifo);
+    fifo_unlock_side(fifo, FIFO_WRITING);
+    fifo_unlock_side(fifo, FIFO_READING);
+
+    if (block)
+        fifo_map_unblock(fifo);
+
+    // Los dormidos tienen que recalcular lo que necesitan (y en modo
+    // registrador los productores ya no esperan huecos)
+    fifo_wake_all(fifo, &fifo->cola_cons);
+    fifo_wake_all(fifo, &fifo->cola_prod);
+    fifo_wake_all(fifo, &fifo->cola_prio);
+
+    return mode;
+}
+
+static long fifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    fifo_t *fifo = fifo_of(filp);
+    int nonblock = filp->f_flags & O_NONBLOCK;
+    struct fifo_info info;
+    struct fifo_wmark wm;
+    struct fifo_policy pol;
+    u64 lost = 0;
+    long ret = 0;
+
+    // Los histogramas son por CPU y no necesitan el mutex
+    if (cmd == FIFO_IOC_GET_LATENCY || cmd == FIFO_IOC_RESET_LATENCY)
+        return fifo_latency_ioctl(fifo, cmd, (void __user *)arg);
+
+    // El VFS no mira el modo de apertura en ioctl: sacar datos o esperarlos
+    // es de consumidores y esperar huecos, de productores
+    if ((cmd == FIFO_IOC_RECV_MSGS || cmd == FIFO_IOC_WAIT_DATA) &&
+            !(filp->f_mode & FMODE_READ))
+        return -EBADF;
+
+    if (cmd == FIFO_IOC_WAIT_SPACE && !(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+
+    // Coge el mutex ella misma (y puede dormir)
+    if (cmd == FIFO_IOC_RECV_MSGS)
+        return fifo_recv_msgs(fifo, (void __user *)arg, nonblock);
+
+    if (cmd == FIFO_IOC_SET_WMARK &&
+            copy_from_user(&wm, (void __user *)arg, sizeof(wm)))
+        return -EFAULT;
+
+    if (cmd == FIFO_IOC_SET_POLICY &&
+            copy_from_user(&pol, (void __user *)arg, sizeof(pol)))
+        return -EFAULT;
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (down_interruptible(&fifo->mutex))
+        return -EINTR;
+
+    switch (cmd){
+    case FIONREAD:
+        ret = size_cbuffer_t(fifo->cbuffer) + size_cbuffer_t(fifo->prio);
+        // En modo paquete, como en un socket de datagramas, el siguiente
+        if (ret && (fifo->mode & FIFO_MODE_PACKET)){
+            struct fifo_msg m = { .hdr.len = 0 };
+            cbuffer_t *cb = fifo_msg_lane(fifo);
+
+            if (cb)
+                peek_items_cbuffer_t(cb, (char *)&m, sizeof(m));
+            ret = m.hdr.len;
+        }
+        if ((fifo->mode & FIFO_MODE_BROADCAST) && (filp->f_mode & FMODE_READ))
+            ret = fifo_bcast_avail(fifo, filp->private_data);
+        break;
+
+    case FIFO_IOC_GET_INFO:
+        info.capacity = fifo->cbuffer->max_size;
+        info.used = size_cbuffer_t(fifo->cbuffer);
+        info.free = info.capacity - info.used;
+        info.num_prod = fifo->num_prod;
+        info.num_cons = fifo->num_cons;
+        info.num_bloq_prod = fifo->num_bloq_prod;
+        info.num_bloq_cons = fifo->num_bloq_cons;
+        break;
+
+    case FIFO_IOC_GET_SIZE:
+        ret = fifo->cbuffer->max_size;
+        break;
+
+    case FIFO_IOC_SET_SIZE:
+        ret = fifo_resize(fifo, arg);
+        break;
+
+    case FIFO_IOC_GET_WMARK:
+        wm.rd_wmark = fifo->rd_wmark;
+        wm.wr_wmark = fifo->wr_wmark;
+        wm.flush_us = div_u64(fifo->flush_ns, NSEC_PER_USEC);
+        wm.pad = 0;
+        break;
+
+    case FIFO_IOC_SET_WMARK:
+        ret = fifo_set_wmark(fifo, &wm);
+        break;
+
+    case FIFO_IOC_GET_POLICY:
+        pol.policy = fifo->policy;
+        pol.ttl_ms = jiffies_to_msecs(fifo->ttl);
+        break;
+
+    case FIFO_IOC_SET_POLICY:
+        ret = fifo_set_policy(fifo, &pol);
+        break;
+
+    case FIFO_IOC_GET_LOST:
+        lost = fifo->lost - ((fifo_file_t *)filp->private_data)->lost;
+        ((fifo_file_t *)filp->private_data)->lost = fifo->lost;
+        break;
+
+    case FIFO_IOC_SET_PRIO:
+        ret = ((fifo_file_t *)filp->private_data)->prio;
+        ((fifo_file_t *)filp->private_data)->prio = (arg != 0);
+        break;
+
+    case FIFO_IOC_GET_LOWAT:
+        ret = fifo->lowat;
+        break;
+
+    case FIFO_IOC_SET_LOWAT:
+        if (arg == 0 || arg > FIFO_SIZE_LIMIT){
+            ret = -EINVAL;
+            break;
+        }
+        fifo->lowat = arg;
+        fifo_wake_all(fifo, &fifo->cola_cons);
+        break;
+
+    case FIFO_IOC_GET_MODE:
+        ret = fifo->mode;
+        break;
+
+    case FIFO_IOC_SET_MODE:
+        ret = fifo_set_mode(fifo, arg);
+        break;
+
+    case FIFO_IOC_WAIT_DATA:
+        while (size_cbuffer_t(fifo->cbuffer) <
+                min_t(unsigned long, arg, fifo->cbuffer->max_size) &&
+                fifo->num_prod > 0){
+            if (nonblock){
+                ret = -EAGAIN;
+                goto out;
+            }
+            if (cond_wait(fifo, &fifo->cola_cons, &fifo->num_bloq_cons,
+                    min_t(unsigned long, arg, fifo->cbuffer->max_size)))
+                return -EINTR;
+        }
+        ret = size_cbuffer_t(fifo->cbuffer);
+        break;
+
+    case FIFO_IOC_WAIT_SPACE:
+        while (nr_gaps_cbuffer_t(fifo->cbuffer) <
+                min_t(unsigned long, arg, fifo->cbuffer->max_size) &&
+                fifo->num_cons > 0){
+            if (nonblock){
+                ret = -EAGAIN;
+                goto out;
+            }
+            if (cond_wait(fifo, &fifo->cola_prod, &fifo->num_bloq_prod,
+                    min_t(unsigned long, arg, fifo->cbuffer->max_size)))
+                return -EINTR;
+        }
+        ret = fifo->num_cons ? nr_gaps_cbuffer_t(fifo->cbuffer) : -EPIPE;
+        break;
+
+    case FIFO_IOC_NOTIFY:
+        fifo_wake_cons(fifo);
+        fifo_wake_prod(fifo);
+        break;
+
+    default:
+        ret = -ENOTTY;
+    }
+
+out:
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    // Las copias al usuario, ya fuera de la sección crítica
+    switch (cmd){
+    case FIONREAD:
+        ret = put_user((int)ret, (int __user *)arg);
+        break;
+
+    case FIFO_IOC_GET_INFO:
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            ret = -EFAULT;
+        break;
+
+    case FIFO_IOC_GET_WMARK:
+        if (copy_to_user((void __user *)arg, &wm, sizeof(wm)))
+            ret = -EFAULT;
+        break;
+
+    case FIFO_IOC_GET_POLICY:
+        if (copy_to_user((void __user *)arg, &pol, sizeof(pol)))
+            ret = -EFAULT;
+        break;
+
+    case FIFO_IOC_GET_LOST:
+        if (put_user(lost, (u64 __user *)arg))
+            ret = -EFAULT;
+        break;
+    }
+
+    return ret;
+}
+
+
+// Cuenta los mapeos del anillo, que impiden redimensionarlo
+static void fifo_vm_open(struct vm_area_struct *vma)
+{
+    fifo_t *fifo = vma->vm_private_data;
+
+    atomic_inc(&fifo->mapped);
+}
+
+static void fifo_vm_close(struct vm_area_struct *vma)
+{
+    fifo_t *fifo = vma->vm_private_data;
+
+    atomic_dec(&fifo->mapped);
+}
+
+static const struct vm_operations_struct fifo_vm_ops = {
+    .open = fifo_vm_open,
+    .close = fifo_vm_close,
+};
+
+static int fifo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    fifo_t *fifo = fifo_of(filp);
+    void *ring = NULL;
+    int ret = 0;
+
+    // Los dos extremos escriben en la cabecera: solo mapeos compartidos
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    // Sin el mutex (ver fifo_map_block): el mapeo se cuenta ya, y con eso
+    // nadie cambia el buffer, el modo ni la política mientras se hace
+    spin_lock(&fifo->map_lock);
+    if (fifo->map_blocked){
+        ret = -EBUSY;
+    }else if ((fifo->mode & (FIFO_MODE_PACKET | FIFO_MODE_BROADCAST |
+                                FIFO_MODE_RECORDER)) ||
+            fifo->policy != FIFO_POLICY_BLOCK){
+        // El protocolo del anillo compartido es de bytes y de un solo
+        // consumidor, y nadie más que él puede mover head
+        ret = -EINVAL;
+    }else{
+        atomic_inc(&fifo->mapped);
+        ring = fifo->cbuffer->ring;
+    }
+    spin_unlock(&fifo->map_lock);
+
+    if (ret)
+        return ret;
+
+    // Cabecera y datos son un solo bloque de vmalloc_user()
+    ret = remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+    if (ret == 0){
+        vma->vm_ops = &fifo_vm_ops;
+        vma->vm_private_data = fifo;
+    }else{
+        atomic_dec(&fifo->mapped);
+    }
+
+    return ret;
+}
+
+
+/*
+ *  API para otros módulos: productores y consumidores dentro del kernel que
+ *  usan el mismo buffer, cerrojos y colas que read/write, sin pasar por el
+ *  espacio de usuario. fifo_kernel_open da de alta los extremos pedidos
+ *  (FMODE_READ/FMODE_WRITE) sin esperar al otro, como con O_NONBLOCK, y
+ *  devuelve un ERR_PTR si falla. Con nonblock, read/write dan -EAGAIN en vez
+ *  de dormir; sin él pueden dormir, así que no valen en contexto atómico.
+ */
+fifo_file_t *fifo_kernel_open(unsigned int minor, fmode_t mode)
+{
+    fifo_file_t *ff;
+    fifo_t *fifo;
+
+    if (minor >= nr_fifos || !(mode & (FMODE_READ | FMODE_WRITE)))
+        return ERR_PTR(-EINVAL);
+
+    if ((ff = kmalloc(sizeof(*ff), GFP_KERNEL)) == NULL)
+        return ERR_PTR(-ENOMEM);
+
+    fifo = &fifos[minor];
+    fifo_init_file(ff, fifo, mode);
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (down_interruptible(&fifo->mutex)){
+        kfree(ff);
+        return ERR_PTR(-EINTR);
+    }
+
+    fifo_get_ends(fifo, ff, (mode & FMODE_READ) != 0,
+                    (mode & FMODE_WRITE) != 0);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    return ff;
+}
+EXPORT_SYMBOL_GPL(fifo_kernel_open);
+
+void fifo_kernel_close(fifo_file_t *ff)
+{
+    fifo_t *fifo = ff->fifo;
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    down(&fifo->mutex);
+
+    fifo_put_ends(fifo, ff, (ff->mode & FMODE_READ) != 0,
+                    (ff->mode & FMODE_WRITE) != 0);
+    trace_fifo_release(fifo, (ff->mode & FMODE_READ) != 0,
+                        (ff->mode & FMODE_WRITE) != 0);
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    kfree(ff);
+}
+EXPORT_SYMBOL_GPL(fifo_kernel_close);
+
+// buf es memoria del kernel: la copia normal con set_fs(KERNEL_DS)
+ssize_t fifo_kernel_write(fifo_file_t *ff, const void *buf, size_t len,
+                            int nonblock)
+{
+    struct iovec iov = {
+        .iov_base = (__force void __user *)buf,
+        .iov_len = len,
+    };
+    mm_segment_t old_fs;
+    ssize_t ret;
+
+    if (!(ff->mode & FMODE_WRITE))
+        return -EBADF;
+
+    trace_fifo_write_enter(ff->fifo, len);
+    old_fs = get_fs();
+    set_fs(get_ds());
+    ret = fifo_do_write(ff->fifo, &iov, len, nonblock, ff->prio);
+    set_fs(old_fs);
+    fifo_account(ff->fifo, ret, 1);
+    trace_fifo_write_exit(ff->fifo, ret);
+
+    return ret;
+}
+EXPORT_SYMBOL_GPL(fifo_kernel_write);
+
+ssize_t fifo_kernel_read(fifo_file_t *ff, void *buf, size_t len, int nonblock)
+{
+    struct iovec iov = {
+        .iov_base = (__force void __user *)buf,
+        .iov_len = len,
+    };
+    mm_segment_t old_fs;
+    ssize_t ret;
+
+    if (!(ff->mode & FMODE_READ))
+        return -EBADF;
+
+    trace_fifo_read_enter(ff->fifo, len);
+    old_fs = get_fs();
+    set_fs(get_ds());
+    ret = fifo_do_read(ff, &iov, len, nonblock);
+    set_fs(old_fs);
+    fifo_account(ff->fifo, ret, 0);
+    trace_fifo_read_exit(ff->fifo, ret);
+
+    return ret;
 }
+EXPORT_SYMBOL_GPL(fifo_kernel_read);
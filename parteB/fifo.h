@@ -0,0 +1,180 @@
+#ifndef FIFO_H
+#define FIFO_H
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <asm/atomic.h>
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
+
+#include "cbuffer.h"
+#include "fifo_ioctl.h"
+
+#define DEVICE_NAME "fifodev"
+#define BUF_LEN 512                 // Capacidad por defecto (parámetro fifo_size)
+#define FIFO_MAX_SIZE (1024*1024)   // Máximo sin CAP_SYS_RESOURCE (fifo_max_size)
+#define FIFO_SIZE_LIMIT (256*1024*1024)
+#define FIFO_PRIO_SIZE 4096         // Capacidad del carril prioritario
+#define NR_FIFOS 8   // Número de FIFOs (minors) por defecto
+#define FIFO_DEBUG
+//#define DEBUG_VERBOSE
+
+#ifdef FIFO_DEBUG
+    #define DBG(format, arg...) do { \
+        printk(KERN_DEBUG "%s: " format "\n" , __func__ , ## arg); \
+    } while (0)
+
+    #ifdef DEBUG_VERBOSE
+        #define DBGV DBG
+    #else
+        #define DBGV(format, args...) /* */
+    #endif
+#else
+    #define DBG(format, arg...) /* */
+    #define DBGV(format, args...) /* */
+#endif
+
+// Bits de fifo_t.busy
+#define FIFO_READING 0
+#define FIFO_WRITING 1
+
+// Modos válidos en FIFO_IOC_SET_MODE
+#define FIFO_MODES (FIFO_MODE_PACKET | FIFO_MODE_BATCH | FIFO_MODE_PARTIAL | \
+                    FIFO_MODE_BROADCAST | FIFO_MODE_GROUP | \
+                    FIFO_MODE_RECORDER)
+
+/*
+ *  Contadores de un FIFO, uno por CPU para no compartir líneas de caché.
+ *  Se suman (high_water: el máximo) al leer /proc/fifodev/<minor>.
+ */
+struct fifo_stats {
+    u64 bytes_in;
+    u64 bytes_out;
+    u64 reads;
+    u64 writes;
+    u64 bloq_prod;      // Veces que se ha dormido un productor
+    u64 bloq_cons;      // Veces que se ha dormido un consumidor
+    u64 epipe;
+    u64 eintr;
+    u64 high_water;     // Ocupación máxima del buffer
+    u64 drop_old;       // Bytes tirados con FIFO_POLICY_DROP_OLDEST
+    u64 drop_new;       // Bytes tirados con FIFO_POLICY_DROP_NEWEST
+    u64 expired;        // Bytes de mensajes caducados (ttl_ms)
+};
+
+#define fifo_stat_add(fifo, field, n) this_cpu_add((fifo)->stats->field, (n))
+#define fifo_stat_inc(fifo, field) fifo_stat_add(fifo, field, 1)
+
+// Cubo log2 del tiempo pasado desde start (ns de local_clock)
+static inline int fifo_lat_bucket(u64 start)
+{
+    return min(fls64(local_clock() - start), FIFO_LAT_BUCKETS - 1);
+}
+
+#define fifo_lat_add(fifo, hist, start) \
+    this_cpu_inc((fifo)->lat->hist[fifo_lat_bucket(start)])
+
+/*
+ *  Estado de un FIFO. Hay uno por cada minor, cada uno con su propio
+ *  buffer, contadores, cerrojo y colas, así que FIFOs distintos no
+ *  compiten entre sí.
+ */
+typedef struct {
+    cbuffer_t* cbuffer;
+    cbuffer_t* prio;                // Carril prioritario (FIFO_IOC_SET_PRIO)
+
+    int num_prod;
+    int num_cons;
+
+    int num_bloq_prod;
+    int num_bloq_cons;
+    unsigned int w_counter;         // Aperturas como productor (POLLHUP)
+
+    struct semaphore mutex;
+    unsigned long busy;             // FIFO_READING/FIFO_WRITING: quién toca el anillo
+    int spsc;                       // Un productor y un consumidor: camino rápido
+    unsigned int mode;              // FIFO_MODE_*
+    unsigned int lowat;             // Mínimo de una lectura parcial
+    unsigned int policy;            // FIFO_POLICY_*
+    unsigned int ttl;               // Caducidad en jiffies (0: no caducan)
+    u64 lost;                       // Bytes tirados del principio del buffer
+    unsigned int rd_wmark, wr_wmark;    // FIFO_IOC_SET_WMARK
+    u64 flush_ns;                   // Retardo máximo de un despertar (0: no)
+    struct hrtimer flush_timer;
+    atomic_t mapped;                // Mapeos (mmap) del anillo
+    spinlock_t map_lock;            // mmap frente a modo, política y tamaño
+    int map_blocked;                // Cambio en curso que no admite mapeos
+    wait_queue_head_t cola_prod, cola_cons;
+    wait_queue_head_t cola_prio;    // Productores esperando en el carril prioritario
+    wait_queue_head_t cola_poll;    // poll/select/epoll
+
+    struct list_head readers;       // fifo_file_t de los consumidores
+    u64 bc_head;                    // Difusión: offset absoluto de head
+    struct list_head grp_queue;     // Grupo: consumidores por orden de turno
+
+    unsigned int minor;
+
+    struct fifo_stats __percpu *stats;
+    struct fifo_latency __percpu *lat;  // Histogramas (FIFO_IOC_GET_LATENCY)
+} fifo_t;
+
+/*
+ *  Lo que es propio de cada apertura (file->private_data).
+ */
+typedef struct {
+    fifo_t *fifo;
+    u64 cursor;                 // Difusión: offset absoluto del siguiente byte
+    struct list_head readers;   // En fifo->readers si es consumidor
+    int prio;                   // Se escribe en el carril prioritario
+    u64 lost;                   // fifo->lost en la última FIFO_IOC_GET_LOST
+    fmode_t mode;               // FMODE_READ/FMODE_WRITE: extremos que cuenta
+    unsigned int w_counter;     // fifo->w_counter visto al abrir sin productores
+} fifo_file_t;
+
+/*
+ *  Cabecera de un mensaje dentro del buffer en modo paquete: la hora a la
+ *  que entró (para el ttl) y su fifo_msg_hdr, lo único que ve el usuario.
+ */
+struct fifo_msg {
+    u32 stamp;                  // jiffies al escribirlo
+    struct fifo_msg_hdr hdr;
+};
+
+#define FIFO_MSG_MIN (sizeof(struct fifo_msg) + 1)
+
+/*
+ *  Entrada de una cola de espera del FIFO. needed es lo que el durmiente
+ *  necesita para avanzar (bytes si es consumidor, huecos si es productor).
+ */
+typedef struct {
+    wait_queue_t wait;
+    int needed;
+} fifo_waiter_t;
+
+/*
+ *   Estadísticas en /proc/fifodev (fifo_stats.c)
+ *   --------------------------------------------
+ */
+int fifo_proc_init(fifo_t *fifos, unsigned int nr_fifos);
+void fifo_proc_exit(unsigned int nr_fifos);
+long fifo_latency_ioctl(fifo_t *fifo, unsigned int cmd,
+                        struct fifo_latency __user *arg);
+
+/*
+ *   API para otros módulos (fifo.c)
+ *   -------------------------------
+ */
+fifo_file_t *fifo_kernel_open(unsigned int minor, fmode_t mode);
+void fifo_kernel_close(fifo_file_t *ff);
+ssize_t fifo_kernel_write(fifo_file_t *ff, const void *buf, size_t len,
+                            int nonblock);
+ssize_t fifo_kernel_read(fifo_file_t *ff, void *buf, size_t len, int nonblock);
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef FIFO_IOCTL_H
+#define FIFO_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ *  ioctls de fifodev. Este fichero lo incluye también espacio de usuario.
+ *
+ *  Anillo compartido (mmap)
+ *  ------------------------
+ *  Con el FIFO abierto O_RDWR se puede mapear (MAP_SHARED) el buffer
+ *  entero: al principio está la cabecera cbuffer_ring_t (cbuffer.h) y los
+ *  datos empiezan en data_offset. El productor solo mueve tail y el
+ *  consumidor solo head, ambos en [0 .. 2*max_size-1]:
+ *
+ *    productor: lee head, escribe los datos, barrera, publica tail
+ *    consumidor: lee tail, barrera, lee los datos, barrera, publica head
+ *
+ *  Solo hace falta entrar al kernel para dormir o despertar:
+ *    - sin datos/huecos: FIFO_IOC_WAIT_DATA/FIFO_IOC_WAIT_SPACE
+ *    - tras publicar, si waiters tiene CBUFFER_WAIT_DATA (productor) o
+ *      CBUFFER_WAIT_SPACE (consumidor), hay que llamar a FIFO_IOC_NOTIFY
+ *      (leyendo waiters después de una barrera completa).
+ */
+#define FIFO_IOC_MAGIC 'F'
+
+/* Capacidad del FIFO (como F_GETPIPE_SZ/F_SETPIPE_SZ). SET conserva lo que
+   haya en el buffer y devuelve la nueva capacidad; -EBUSY si no cabe o si el
+   anillo está mapeado */
+#define FIFO_IOC_GET_SIZE    _IO(FIFO_IOC_MAGIC, 0x01)
+#define FIFO_IOC_SET_SIZE    _IO(FIFO_IOC_MAGIC, 0x02)
+
+/* Foto del estado del FIFO. FIONREAD también está soportado */
+struct fifo_info {
+    __u32 capacity;         /* Capacidad del buffer */
+    __u32 used;             /* Bytes en el buffer */
+    __u32 free;             /* Huecos en el buffer */
+    __u32 num_prod;         /* Productores abiertos */
+    __u32 num_cons;         /* Consumidores abiertos */
+    __u32 num_bloq_prod;    /* Productores dormidos */
+    __u32 num_bloq_cons;    /* Consumidores dormidos */
+};
+#define FIFO_IOC_GET_INFO    _IOR(FIFO_IOC_MAGIC, 0x03, struct fifo_info)
+
+/* Histogramas de latencia en ns, en cubos log2: el cubo b cuenta los tiempos
+   en [2^(b-1), 2^b) (el 0, los nulos; el último, todo lo que no cabe).
+   RESET los pone a cero */
+#define FIFO_LAT_BUCKETS 32
+struct fifo_latency {
+    __u64 mutex[FIFO_LAT_BUCKETS];      /* Espera por el mutex del FIFO */
+    __u64 bloq_prod[FIFO_LAT_BUCKETS];  /* Productor dormido esperando huecos */
+    __u64 bloq_cons[FIFO_LAT_BUCKETS];  /* Consumidor dormido esperando datos */
+    __u64 copy[FIFO_LAT_BUCKETS];       /* Copia entre el usuario y el buffer */
+};
+#define FIFO_IOC_GET_LATENCY   _IOR(FIFO_IOC_MAGIC, 0x04, struct fifo_latency)
+#define FIFO_IOC_RESET_LATENCY _IO(FIFO_IOC_MAGIC, 0x05)
+
+/* Modo del FIFO. Pasar a PACKET o dejarlo exige el buffer vacío y sin mapear
+   (-EBUSY). En PACKET cada write es un mensaje (atómico; -EMSGSIZE si no
+   cabe en el buffer) y cada read devuelve uno entero, truncado (y el resto
+   descartado) si no cabe en lo pedido. Con BATCH además, read devuelve todos
+   los mensajes enteros que quepan, cada uno precedido de su fifo_msg_hdr
+   (-EMSGSIZE si no cabe ni el primero). FIONREAD da la longitud del
+   siguiente. Ni mmap ni splice valen en PACKET (-EINVAL) */
+#define FIFO_MODE_PACKET     0x1
+#define FIFO_MODE_BATCH      0x2
+struct fifo_msg_hdr {
+    __u32 len;              /* Bytes del mensaje, sin la cabecera */
+};
+#define FIFO_IOC_GET_MODE    _IO(FIFO_IOC_MAGIC, 0x06)
+#define FIFO_IOC_SET_MODE    _IO(FIFO_IOC_MAGIC, 0x07)
+
+/* Lectura parcial (de bytes, como read(2) en un pipe): read no espera a tener
+   todo lo pedido, vuelve en cuanto hay lowat bytes (1 por defecto, como
+   SO_RCVLOWAT) y se lleva lo que haya hasta lo pedido. Sin él, read espera
+   a lo pedido, pero nunca a más de la capacidad menos PIPE_BUF - 1 bytes
+   (con un buffer de PIPE_BUF o menos, a 1 byte) */
+#define FIFO_MODE_PARTIAL    0x4
+#define FIFO_IOC_GET_LOWAT   _IO(FIFO_IOC_MAGIC, 0x0b)
+#define FIFO_IOC_SET_LOWAT   _IO(FIFO_IOC_MAGIC, 0x0c)
+
+/* Difusión: cada consumidor tiene su propio cursor y lee todo lo que se
+   escribe desde que abrió; un hueco solo se libera cuando lo ha leído el más
+   lento. Exige el buffer vacío y sin mapear para entrar o salir (-EBUSY) y
+   no se combina con PACKET. FIONREAD y poll miran lo pendiente de cada uno.
+   Ni mmap ni splice_read valen en difusión (-EINVAL) */
+#define FIFO_MODE_BROADCAST  0x8
+
+/* Grupo de consumidores (solo con PACKET): cada mensaje es para un solo
+   consumidor y no para el primero que coja el cerrojo, sino para el que
+   lleva más tiempo esperando: las lecturas hacen cola por orden de llegada
+   (no se mira cuánto trabajo tiene cada consumidor). Con O_NONBLOCK, si no
+   es su turno, -EAGAIN; poll solo da POLLIN cuando no hay lecturas
+   esperando turno */
+#define FIFO_MODE_GROUP      0x10
+
+/* Registrador de vuelo (telemetría): write nunca espera ni falla por falta
+   de consumidores (ni open por falta del otro extremo); si no cabe se tira
+   lo más antiguo (de una escritura mayor que el buffer solo queda el final)
+   y el buffer no se vacía al cerrarse todos. Así un consumidor puede
+   engancharse cuando quiera y volcar lo último. FIFO_IOC_GET_LOST da los
+   bytes perdidos desde la última consulta por ese descriptor (o desde que
+   se abrió), también con FIFO_POLICY_DROP_OLDEST. No se combina con
+   difusión (-EINVAL) ni se puede mapear (-EBUSY/-EINVAL) */
+#define FIFO_MODE_RECORDER   0x20
+#define FIFO_IOC_GET_LOST    _IOR(FIFO_IOC_MAGIC, 0x10, __u64)
+
+/* Recepción de varios mensajes de una vez (solo en PACKET), como recvmmsg.
+   Saca hasta max_msgs mensajes enteros que quepan en buf_len, con sus datos
+   seguidos en buf y sus longitudes en lens[]. Espera (salvo O_NONBLOCK) a que
+   haya al menos uno y devuelve cuántos ha sacado (también en nr_msgs); 0 es
+   EOF y -EMSGSIZE si el primero no cabe en buf_len. Un mensaje que no se
+   puede copiar (-EFAULT) se queda en el buffer. Solo para descriptores
+   abiertos en lectura (-EBADF) */
+struct fifo_recv {
+    __u64 buf;              /* Datos (puntero de usuario) */
+    __u64 lens;             /* __u32[max_msgs] (puntero de usuario) */
+    __u32 buf_len;          /* Bytes como mucho */
+    __u32 max_msgs;         /* Mensajes como mucho */
+    __u32 nr_msgs;          /* Salida: mensajes sacados */
+    __u32 pad;
+};
+#define FIFO_IOC_RECV_MSGS   _IOWR(FIFO_IOC_MAGIC, 0x08, struct fifo_recv)
+
+/* Marcas para despertar. A los consumidores dormidos (y a poll) no se les
+   despierta hasta que haya rd_wmark bytes, ni a los productores hasta que
+   haya wr_wmark huecos (1 es lo normal: en cuanto se pueda avanzar). Con
+   flush_us, lo que quede por despertar por debajo de la marca se despierta
+   como tarde al cabo de flush_us microsegundos; con 0 espera a la marca o
+   a que se cierre un extremo. La marca de un lado no se respeta mientras el
+   otro tenga a alguien dormido: con escrituras atómicas o en paquetes el
+   buffer puede no llenarse nunca del todo y se esperarían los dos */
+struct fifo_wmark {
+    __u32 rd_wmark;         /* Bytes para despertar consumidores */
+    __u32 wr_wmark;         /* Huecos para despertar productores */
+    __u32 flush_us;         /* Retardo máximo (0: sin temporizador) */
+    __u32 pad;
+};
+#define FIFO_WMARK_MAX_FLUSH 1000000
+#define FIFO_IOC_GET_WMARK   _IOR(FIFO_IOC_MAGIC, 0x09, struct fifo_wmark)
+#define FIFO_IOC_SET_WMARK   _IOW(FIFO_IOC_MAGIC, 0x0a, struct fifo_wmark)
+
+/* Carril prioritario: con FIFO_IOC_SET_PRIO(1) lo que se escribe por ese
+   descriptor va a un segundo buffer pequeño (FIFO_PRIO_SIZE) que read vacía
+   antes que el normal; dentro de cada carril se conserva el orden. Cada
+   escritura prioritaria es atómica (-EMSGSIZE si no cabe) y en PACKET es un
+   mensaje. No vale en difusión (-EINVAL) y no lo ven ni mmap ni splice.
+   Devuelve el valor anterior */
+#define FIFO_IOC_SET_PRIO    _IO(FIFO_IOC_MAGIC, 0x0d)
+
+/* Qué hacer cuando lo que se escribe no cabe, en vez de dormir al productor.
+   DROP_OLDEST tira lo más antiguo del buffer (mensajes enteros en PACKET)
+   hasta que quepa; DROP_NEWEST tira lo nuevo que no cabe (lo que falte de
+   una escritura por trozos, entera si es atómica o un mensaje) y write lo da
+   por escrito. Con ttl_ms, en PACKET, los mensajes que llevan más de ttl_ms
+   en el buffer caducan y se tiran sin entregarlos. Lo tirado se cuenta en
+   /proc/fifodev/<minor>. DROP_NEWEST solo afecta al buffer normal; la
+   caducidad y DROP_OLDEST valen también en el carril prioritario. No se
+   puede con el anillo
+   mapeado (-EBUSY) ni DROP_OLDEST en difusión (-EINVAL) */
+#define FIFO_POLICY_BLOCK        0
+#define FIFO_POLICY_DROP_OLDEST  1
+#define FIFO_POLICY_DROP_NEWEST  2
+struct fifo_policy {
+    __u32 policy;           /* FIFO_POLICY_* */
+    __u32 ttl_ms;           /* Caducidad de los mensajes (0: no caducan) */
+};
+#define FIFO_POLICY_MAX_TTL  3600000
+#define FIFO_IOC_GET_POLICY  _IOR(FIFO_IOC_MAGIC, 0x0e, struct fifo_policy)
+#define FIFO_IOC_SET_POLICY  _IOW(FIFO_IOC_MAGIC, 0x0f, struct fifo_policy)
+
+/* Duerme hasta que haya arg bytes. Devuelve los bytes que hay (0 es EOF).
+   Solo en lectura (-EBADF) */
+#define FIFO_IOC_WAIT_DATA   _IO(FIFO_IOC_MAGIC, 0x80)
+/* Duerme hasta que haya arg huecos. Devuelve los huecos (-EPIPE sin lectores).
+   Solo en escritura (-EBADF) */
+#define FIFO_IOC_WAIT_SPACE  _IO(FIFO_IOC_MAGIC, 0x81)
+/* Se han publicado datos o huecos en el anillo: despierta a quien toque */
+#define FIFO_IOC_NOTIFY      _IO(FIFO_IOC_MAGIC, 0x82)
+
+#endif
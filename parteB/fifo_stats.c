@@ -0,0 +1,159 @@
+#include <linux/proc_fs.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <asm-generic/uaccess.h>
+
+#include "fifo.h"
+
+static struct proc_dir_entry *fifo_proc_dir;
+
+
+/*   ##########################################
+ *   Funciones de manejo de entradas /proc
+ *   ------------------------------------------
+ */
+
+/*
+ *  /proc/fifodev/<minor>: estado del FIFO y suma de sus contadores por CPU.
+ *  Todo cabe en una página, así que solo se atiende la lectura desde 0.
+ */
+static int fifo_proc_read(char *buffer, char **buffer_location,
+        off_t offset, int buffer_len, int *eof, void *data)
+{
+    fifo_t *fifo = data;
+    struct fifo_stats sum, *st;
+    int cpu, used = 0, size, capacity;
+    int num_prod, num_cons, num_bloq_prod, num_bloq_cons;
+
+    if (offset > 0){
+        *eof = 1;
+        return 0;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu){
+        st = per_cpu_ptr(fifo->stats, cpu);
+        sum.bytes_in += st->bytes_in;
+        sum.bytes_out += st->bytes_out;
+        sum.reads += st->reads;
+        sum.writes += st->writes;
+        sum.bloq_prod += st->bloq_prod;
+        sum.bloq_cons += st->bloq_cons;
+        sum.epipe += st->epipe;
+        sum.eintr += st->eintr;
+        sum.high_water = max(sum.high_water, st->high_water);
+        sum.drop_old += st->drop_old;
+        sum.drop_new += st->drop_new;
+        sum.expired += st->expired;
+    }
+
+    // INICIO SECCIÓN CRÍTICA >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
+    if (down_interruptible(&fifo->mutex))
+        return -EINTR;
+
+    capacity = fifo->cbuffer->max_size;
+    size = size_cbuffer_t(fifo->cbuffer);
+    num_prod = fifo->num_prod;
+    num_cons = fifo->num_cons;
+    num_bloq_prod = fifo->num_bloq_prod;
+    num_bloq_cons = fifo->num_bloq_cons;
+
+    up(&fifo->mutex);
+    // FIN SECCIÓN CRÍTICA <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+
+    used += snprintf(buffer + used, buffer_len - used,
+            "capacity %d\nused %d\nprod %d\ncons %d\n"
+            "bloq_prod %d\nbloq_cons %d\n",
+            capacity, size, num_prod, num_cons,
+            num_bloq_prod, num_bloq_cons);
+    used += snprintf(buffer + used, buffer_len - used,
+            "bytes_in %llu\nbytes_out %llu\nreads %llu\nwrites %llu\n"
+            "sleeps_prod %llu\nsleeps_cons %llu\nepipe %llu\neintr %llu\n"
+            "high_water %llu\ndrop_old %llu\ndrop_new %llu\nexpired %llu\n",
+            sum.bytes_in, sum.bytes_out, sum.reads, sum.writes,
+            sum.bloq_prod, sum.bloq_cons, sum.epipe, sum.eintr,
+            sum.high_water, sum.drop_old, sum.drop_new, sum.expired);
+
+    *eof = 1;
+    return min(used, buffer_len);
+}
+
+
+/*
+ *  FIFO_IOC_GET_LATENCY/FIFO_IOC_RESET_LATENCY. Los cubos se suman (o se
+ *  ponen a cero) CPU a CPU sin parar a nadie, así que una foto tomada con
+ *  tráfico puede no cuadrar del todo con los contadores de /proc.
+ */
+long fifo_latency_ioctl(fifo_t *fifo, unsigned int cmd,
+                        struct fifo_latency __user *arg)
+{
+    struct fifo_latency *sum, *lat;
+    int cpu, b;
+    long ret = 0;
+
+    if (cmd == FIFO_IOC_RESET_LATENCY){
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(fifo->lat, cpu), 0, sizeof(*sum));
+        return 0;
+    }
+
+    // Demasiado grande para la pila
+    if ((sum = kzalloc(sizeof(*sum), GFP_KERNEL)) == NULL)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu){
+        lat = per_cpu_ptr(fifo->lat, cpu);
+        for (b = 0; b < FIFO_LAT_BUCKETS; b++){
+            sum->mutex[b] += lat->mutex[b];
+            sum->bloq_prod[b] += lat->bloq_prod[b];
+            sum->bloq_cons[b] += lat->bloq_cons[b];
+            sum->copy[b] += lat->copy[b];
+        }
+    }
+
+    if (copy_to_user(arg, sum, sizeof(*sum)))
+        ret = -EFAULT;
+
+    kfree(sum);
+    return ret;
+}
+
+
+/*   ###########################################
+ *   Creación y borrado de las entradas
+ *   -------------------------------------------
+ */
+int fifo_proc_init(fifo_t *fifos, unsigned int nr_fifos)
+{
+    struct proc_dir_entry *entry;
+    char name[16];
+    unsigned int i;
+
+    if ((fifo_proc_dir = proc_mkdir(DEVICE_NAME, NULL)) == NULL)
+        return -ENOMEM;
+
+    for (i = 0; i < nr_fifos; i++){
+        snprintf(name, sizeof(name), "%u", i);
+        if ((entry = create_proc_entry(name, 0444, fifo_proc_dir)) == NULL){
+            fifo_proc_exit(i);
+            return -ENOMEM;
+        }
+        entry->read_proc = fifo_proc_read;
+        entry->data = &fifos[i];
+    }
+
+    DBG("[fifodev] Creado /proc/%s", DEVICE_NAME);
+    return 0;
+}
+
+void fifo_proc_exit(unsigned int nr_fifos)
+{
+    char name[16];
+    unsigned int i;
+
+    for (i = 0; i < nr_fifos; i++){
+        snprintf(name, sizeof(name), "%u", i);
+        remove_proc_entry(name, fifo_proc_dir);
+    }
+    remove_proc_entry(DEVICE_NAME, NULL);
+}
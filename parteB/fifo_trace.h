@@ -0,0 +1,206 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fifodev
+
+#if !defined(_FIFO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FIFO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "fifo.h"
+
+/*
+ *  Tracepoints de fifodev (/sys/kernel/debug/tracing/events/fifodev).
+ *
+ *  La ocupación se lee al disparar el evento, a veces sin el mutex: las
+ *  sondas corren con la apropiación desactivada y fifo_resize espera con
+ *  synchronize_sched() antes de liberar el buffer viejo.
+ */
+#ifndef FIFO_TRACE_USED
+#define FIFO_TRACE_USED
+static inline int fifo_trace_used(fifo_t *fifo)
+{
+    return size_cbuffer_t(ACCESS_ONCE(fifo->cbuffer));
+}
+#endif
+
+// Apertura y cierre, con los extremos que quedan
+DECLARE_EVENT_CLASS(fifo_ends,
+
+    TP_PROTO(fifo_t *fifo, int is_cons, int is_prod),
+
+    TP_ARGS(fifo, is_cons, is_prod),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, is_cons)
+        __field(int, is_prod)
+        __field(int, num_cons)
+        __field(int, num_prod)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->is_cons = is_cons;
+        __entry->is_prod = is_prod;
+        __entry->num_cons = fifo->num_cons;
+        __entry->num_prod = fifo->num_prod;
+    ),
+
+    TP_printk("minor=%u mode=%s%s cons=%d prod=%d",
+        __entry->minor,
+        __entry->is_cons ? "r" : "", __entry->is_prod ? "w" : "",
+        __entry->num_cons, __entry->num_prod)
+);
+
+DEFINE_EVENT(fifo_ends, fifo_open,
+    TP_PROTO(fifo_t *fifo, int is_cons, int is_prod),
+    TP_ARGS(fifo, is_cons, is_prod));
+
+DEFINE_EVENT(fifo_ends, fifo_release,
+    TP_PROTO(fifo_t *fifo, int is_cons, int is_prod),
+    TP_ARGS(fifo, is_cons, is_prod));
+
+// Entrada en read/write con lo pedido
+DECLARE_EVENT_CLASS(fifo_io_enter,
+
+    TP_PROTO(fifo_t *fifo, size_t len),
+
+    TP_ARGS(fifo, len),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, len)
+        __field(int, used)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->len = len;
+        __entry->used = fifo_trace_used(fifo);
+    ),
+
+    TP_printk("minor=%u len=%zu used=%d",
+        __entry->minor, __entry->len, __entry->used)
+);
+
+DEFINE_EVENT(fifo_io_enter, fifo_read_enter,
+    TP_PROTO(fifo_t *fifo, size_t len),
+    TP_ARGS(fifo, len));
+
+DEFINE_EVENT(fifo_io_enter, fifo_write_enter,
+    TP_PROTO(fifo_t *fifo, size_t len),
+    TP_ARGS(fifo, len));
+
+// Salida de read/write con lo devuelto (bytes o -errno)
+DECLARE_EVENT_CLASS(fifo_io_exit,
+
+    TP_PROTO(fifo_t *fifo, ssize_t ret),
+
+    TP_ARGS(fifo, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(ssize_t, ret)
+        __field(int, used)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->ret = ret;
+        __entry->used = fifo_trace_used(fifo);
+    ),
+
+    TP_printk("minor=%u ret=%zd used=%d",
+        __entry->minor, __entry->ret, __entry->used)
+);
+
+DEFINE_EVENT(fifo_io_exit, fifo_read_exit,
+    TP_PROTO(fifo_t *fifo, ssize_t ret),
+    TP_ARGS(fifo, ret));
+
+DEFINE_EVENT(fifo_io_exit, fifo_write_exit,
+    TP_PROTO(fifo_t *fifo, ssize_t ret),
+    TP_ARGS(fifo, ret));
+
+// Un productor o consumidor se va a dormir necesitando needed
+TRACE_EVENT(fifo_block,
+
+    TP_PROTO(fifo_t *fifo, int prod, int needed),
+
+    TP_ARGS(fifo, prod, needed),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, prod)
+        __field(int, needed)
+        __field(int, used)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->prod = prod;
+        __entry->needed = needed;
+        __entry->used = fifo_trace_used(fifo);
+    ),
+
+    TP_printk("minor=%u %s needed=%d used=%d",
+        __entry->minor, __entry->prod ? "prod" : "cons",
+        __entry->needed, __entry->used)
+);
+
+// Vuelve de dormir (intr si ha sido por una señal)
+TRACE_EVENT(fifo_wakeup,
+
+    TP_PROTO(fifo_t *fifo, int prod, int intr),
+
+    TP_ARGS(fifo, prod, intr),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, prod)
+        __field(int, intr)
+        __field(int, used)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->prod = prod;
+        __entry->intr = intr;
+        __entry->used = fifo_trace_used(fifo);
+    ),
+
+    TP_printk("minor=%u %s%s used=%d",
+        __entry->minor, __entry->prod ? "prod" : "cons",
+        __entry->intr ? " intr" : "", __entry->used)
+);
+
+// Se despierta a una cola con budget bytes (cons) o huecos (prod)
+TRACE_EVENT(fifo_wake,
+
+    TP_PROTO(fifo_t *fifo, int prod, int budget),
+
+    TP_ARGS(fifo, prod, budget),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, prod)
+        __field(int, budget)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = fifo->minor;
+        __entry->prod = prod;
+        __entry->budget = budget;
+    ),
+
+    TP_printk("minor=%u %s budget=%d",
+        __entry->minor, __entry->prod ? "prod" : "cons", __entry->budget)
+);
+
+#endif /* _FIFO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fifo_trace
+#include <trace/define_trace.h>
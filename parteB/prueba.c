@@ -0,0 +1,533 @@
+/*
+ *  Pruebas de fifodev desde espacio de usuario.
+ *
+ *    prueba <dispositivo>        los caminos que duermen y despiertan (marcas,
+ *                                registrador, lecturas grandes, POLLHUP), los
+ *                                modos, los ioctls, mmap y splice
+ *    prueba <dispositivo> <MB>   solo mide los cambios de contexto por MB con
+ *                                varios productores y consumidores; no usa
+ *                                ioctls, así que vale también con versiones
+ *                                antiguas del módulo para comparar
+ *
+ *  El minor tiene que estar sin usar: cada prueba deja el FIFO como recién
+ *  cargado antes de empezar. Una prueba que no acaba en PLAZO segundos se da
+ *  por colgada.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "fifo_ioctl.h"
+#include "cbuffer.h"
+
+#define PLAZO 5             // Segundos para dar una prueba por colgada
+#define TAM_DEFECTO 512     // BUF_LEN en fifo.h
+
+#define COMPROBAR(cond) \
+    do { \
+        if (!(cond)){ \
+            fprintf(stderr, "    %s:%d: %s (%s)\n", __FILE__, __LINE__, \
+                    #cond, strerror(errno)); \
+            return 1; \
+        } \
+    } while (0)
+
+static const char *dev;
+
+static int abrir(int flags)
+{
+    int fd = open(dev, flags);
+
+    if (fd < 0){
+        perror(dev);
+        exit(1);
+    }
+    return fd;
+}
+
+// Deja el FIFO como recién cargado: sin modo ni política, vacío y con
+// la capacidad y las marcas por defecto
+static int reiniciar(void)
+{
+    struct fifo_policy pol = { FIFO_POLICY_BLOCK, 0 };
+    struct fifo_wmark wm = { 1, 1, 0, 0 };
+    char buf[4096];
+    int fd = abrir(O_RDWR | O_NONBLOCK);
+
+    // Con datos no se puede salir de PACKET
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_MODE, 0) == 0);
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_POLICY, &pol) == 0);
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_WMARK, &wm) == 0);
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_LOWAT, 1) == 0);
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_SIZE, TAM_DEFECTO) == TAM_DEFECTO);
+    close(fd);
+    return 0;
+}
+
+// Un consumidor (sin bloqueo, para no esperar al productor) y un productor
+static void abrir_par(int *fd_r, int *fd_w)
+{
+    *fd_r = abrir(O_RDONLY | O_NONBLOCK);
+    *fd_w = abrir(O_WRONLY);
+}
+
+static void bloquear(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+// Productor en otro proceso: veces escrituras de len bytes, tras espera us
+static pid_t productor(int fd_w, size_t len, int veces, useconds_t espera)
+{
+    char buf[8192];
+    pid_t pid = fork();
+    int i;
+
+    if (pid)
+        return pid;
+
+    memset(buf, 'x', sizeof(buf));
+    usleep(espera);
+    for (i = 0; i < veces; i++)
+        if (write(fd_w, buf, len) != (ssize_t)len)
+            exit(1);
+    exit(0);
+}
+
+static int esperar_hijo(pid_t pid)
+{
+    int status;
+
+    if (waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Lee hasta total bytes en lecturas de len
+static int leer_todo(int fd_r, size_t len, size_t total)
+{
+    char buf[16384];
+    size_t leidos = 0;
+    ssize_t n;
+
+    while (leidos < total){
+        n = read(fd_r, buf, len);
+        COMPROBAR(n > 0);
+        leidos += n;
+    }
+    return 0;
+}
+
+/*
+ *  Una lectura mayor que el buffer no puede esperar a que se llene del todo:
+ *  un productor atómico dormido deja huecos libres.
+ */
+static int prueba_lectura_grande(void)
+{
+    int fd_r, fd_w;
+    pid_t pid;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_SIZE, 8192) == 8192);
+    bloquear(fd_r);
+
+    pid = productor(fd_w, 1000, 20, 0);
+    close(fd_w);
+    COMPROBAR(leer_todo(fd_r, 16384, 20000) == 0);
+    COMPROBAR(esperar_hijo(pid) == 0);
+    close(fd_r);
+    return 0;
+}
+
+/*
+ *  Con rd_wmark igual a la capacidad y escrituras de 100 bytes el buffer se
+ *  queda en 500: el productor duerme y el consumidor tiene que despertar.
+ */
+static int prueba_marca(void)
+{
+    struct fifo_wmark wm = { TAM_DEFECTO, 1, 0, 0 };
+    int fd_r, fd_w;
+    pid_t pid;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_WMARK, &wm) == 0);
+    bloquear(fd_r);
+
+    // El consumidor se duerme antes de que empiece a escribir
+    pid = productor(fd_w, 100, 50, 100000);
+    close(fd_w);
+    COMPROBAR(leer_todo(fd_r, 100, 5000) == 0);
+    COMPROBAR(esperar_hijo(pid) == 0);
+    close(fd_r);
+    return 0;
+}
+
+// Un productor dormido con el buffer lleno sigue al pasar a registrador
+static int prueba_registrador(void)
+{
+    int fd_r, fd_w;
+    pid_t pid;
+
+    abrir_par(&fd_r, &fd_w);
+    pid = productor(fd_w, 300, 2, 0);
+    close(fd_w);
+
+    usleep(200000);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_MODE, FIFO_MODE_RECORDER) ==
+                FIFO_MODE_RECORDER);
+    COMPROBAR(esperar_hijo(pid) == 0);
+    close(fd_r);
+    return 0;
+}
+
+// POLLHUP solo cuando un productor ha llegado y se ha ido
+static int prueba_pollhup(void)
+{
+    struct pollfd pfd;
+    int fd_w;
+
+    pfd.fd = abrir(O_RDONLY | O_NONBLOCK);
+    pfd.events = POLLIN;
+    COMPROBAR(poll(&pfd, 1, 0) == 0);
+
+    fd_w = abrir(O_WRONLY);
+    COMPROBAR(poll(&pfd, 1, 0) == 0);
+    close(fd_w);
+
+    COMPROBAR(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP));
+    close(pfd.fd);
+    return 0;
+}
+
+// Sin sitio para una escritura atómica no hay POLLOUT; al vaciarlo, sí
+static int prueba_pollout(void)
+{
+    struct pollfd pfd;
+    char buf[TAM_DEFECTO];
+    int fd_r;
+
+    abrir_par(&fd_r, &pfd.fd);
+    pfd.events = POLLOUT;
+    COMPROBAR(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT));
+
+    memset(buf, 'x', sizeof(buf));
+    COMPROBAR(write(pfd.fd, buf, 100) == 100);
+    COMPROBAR(poll(&pfd, 1, 0) == 0);
+
+    COMPROBAR(read(fd_r, buf, sizeof(buf)) == 100);
+    COMPROBAR(poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT));
+    close(pfd.fd);
+    close(fd_r);
+    return 0;
+}
+
+static int prueba_paquetes(void)
+{
+    struct fifo_recv req;
+    __u32 lens[8];
+    char buf[64];
+    int fd_r, fd_w;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_MODE, FIFO_MODE_PACKET) ==
+                FIFO_MODE_PACKET);
+
+    COMPROBAR(write(fd_w, "uno", 3) == 3);
+    COMPROBAR(write(fd_w, "dos!", 4) == 4);
+    COMPROBAR(write(fd_w, "tres..", 6) == 6);
+
+    memset(&req, 0, sizeof(req));
+    req.buf = (unsigned long)buf;
+    req.lens = (unsigned long)lens;
+    req.buf_len = sizeof(buf);
+    req.max_msgs = 8;
+
+    // Sacar mensajes es de consumidores
+    errno = 0;
+    COMPROBAR(ioctl(fd_w, FIFO_IOC_RECV_MSGS, &req) < 0 && errno == EBADF);
+
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_RECV_MSGS, &req) == 3);
+    COMPROBAR(req.nr_msgs == 3);
+    COMPROBAR(lens[0] == 3 && lens[1] == 4 && lens[2] == 6);
+    COMPROBAR(memcmp(buf, "unodos!tres..", 13) == 0);
+
+    // Un mensaje que no cabe se trunca y el resto se tira
+    COMPROBAR(write(fd_w, "cuatro", 6) == 6);
+    COMPROBAR(read(fd_r, buf, 3) == 3 && memcmp(buf, "cua", 3) == 0);
+    errno = 0;
+    COMPROBAR(read(fd_r, buf, sizeof(buf)) < 0 && errno == EAGAIN);
+
+    close(fd_w);
+    close(fd_r);
+    return 0;
+}
+
+// Lectura parcial: read vuelve con lowat bytes aunque pida más
+static int prueba_parcial(void)
+{
+    char buf[256];
+    int fd_r, fd_w;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_MODE, FIFO_MODE_PARTIAL) ==
+                FIFO_MODE_PARTIAL);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_LOWAT, 10) == 0);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_GET_LOWAT) == 10);
+
+    memset(buf, 'x', sizeof(buf));
+    COMPROBAR(write(fd_w, buf, 5) == 5);
+    errno = 0;
+    COMPROBAR(read(fd_r, buf, sizeof(buf)) < 0 && errno == EAGAIN);
+    COMPROBAR(write(fd_w, buf, 7) == 7);
+    COMPROBAR(read(fd_r, buf, sizeof(buf)) == 12);
+
+    close(fd_w);
+    close(fd_r);
+    return 0;
+}
+
+static int prueba_info(void)
+{
+    struct fifo_info info;
+    int fd_r, fd_w, n;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_GET_SIZE) == TAM_DEFECTO);
+    COMPROBAR(write(fd_w, "hola", 4) == 4);
+
+    COMPROBAR(ioctl(fd_r, FIONREAD, &n) == 0 && n == 4);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_GET_INFO, &info) == 0);
+    COMPROBAR(info.capacity == TAM_DEFECTO && info.used == 4);
+    COMPROBAR(info.num_prod == 1 && info.num_cons == 1);
+
+    // Redimensionar conserva lo que hay
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_SIZE, 2048) == 2048);
+    COMPROBAR(ioctl(fd_r, FIONREAD, &n) == 0 && n == 4);
+
+    close(fd_w);
+    close(fd_r);
+    return 0;
+}
+
+static int prueba_splice(void)
+{
+    char buf[1000], copia[1000];
+    int fd_r, fd_w, p[2], i;
+
+    abrir_par(&fd_r, &fd_w);
+    COMPROBAR(pipe(p) == 0);
+    COMPROBAR(ioctl(fd_r, FIFO_IOC_SET_SIZE, 4096) == 4096);
+
+    for (i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = i;
+    COMPROBAR(write(fd_w, buf, sizeof(buf)) == sizeof(buf));
+
+    COMPROBAR(splice(fd_r, NULL, p[1], NULL, 4096, SPLICE_F_NONBLOCK) ==
+                sizeof(buf));
+    COMPROBAR(read(p[0], copia, sizeof(copia)) == sizeof(copia));
+    COMPROBAR(memcmp(buf, copia, sizeof(buf)) == 0);
+
+    // Y de vuelta, del pipe al FIFO
+    COMPROBAR(write(p[1], buf, sizeof(buf)) == sizeof(buf));
+    COMPROBAR(splice(p[0], NULL, fd_w, NULL, sizeof(buf), 0) == sizeof(buf));
+    COMPROBAR(read(fd_r, copia, sizeof(copia)) == sizeof(copia));
+    COMPROBAR(memcmp(buf, copia, sizeof(buf)) == 0);
+
+    close(p[0]);
+    close(p[1]);
+    close(fd_w);
+    close(fd_r);
+    return 0;
+}
+
+// Consumidor por el anillo compartido de lo que escribe write
+static int prueba_mmap(void)
+{
+    long pagina = sysconf(_SC_PAGESIZE);
+    cbuffer_ring_t *ring;
+    unsigned int head, max;
+    size_t len;
+    char *data;
+    int fd, n;
+
+    fd = abrir(O_RDWR | O_NONBLOCK);
+
+    ring = mmap(NULL, pagina, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    COMPROBAR(ring != MAP_FAILED);
+    max = ring->max_size;
+    COMPROBAR(max == (unsigned int)ioctl(fd, FIFO_IOC_GET_SIZE));
+    len = (ring->data_offset + max + pagina - 1) & ~(pagina - 1);
+    munmap(ring, pagina);
+
+    ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    COMPROBAR(ring != MAP_FAILED);
+    data = (char *)ring + ring->data_offset;
+
+    // Mapeado no se puede redimensionar
+    errno = 0;
+    COMPROBAR(ioctl(fd, FIFO_IOC_SET_SIZE, 2048) < 0 && errno == EBUSY);
+
+    COMPROBAR(write(fd, "hola", 4) == 4);
+    __sync_synchronize();
+    head = ring->head;
+    COMPROBAR((ring->tail + 2 * max - head) % (2 * max) == 4);
+    COMPROBAR(memcmp(data + head % max, "hola", 4) == 0);
+
+    // Publica head y avisa si hay productores esperando huecos
+    __sync_synchronize();
+    ring->head = (head + 4) % (2 * max);
+    __sync_synchronize();
+    if (ring->waiters & CBUFFER_WAIT_SPACE)
+        ioctl(fd, FIFO_IOC_NOTIFY);
+
+    COMPROBAR(ioctl(fd, FIONREAD, &n) == 0 && n == 0);
+    munmap(ring, len);
+    close(fd);
+    return 0;
+}
+
+static int probar(const char *nombre, int (*prueba)(void))
+{
+    pid_t pid;
+    int status;
+
+    printf("%-24s", nombre);
+    fflush(stdout);
+
+    if ((pid = fork()) == 0){
+        // Un grupo propio para poder matar también a sus productores
+        setpgid(0, 0);
+        alarm(PLAZO);
+        exit(reiniciar() || prueba());
+    }
+
+    waitpid(pid, &status, 0);
+    kill(-pid, SIGKILL);
+
+    if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM){
+        printf("COLGADA\n");
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)){
+        printf("FALLO\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
+
+/*
+ *  Cambios de contexto por MB con varios productores y consumidores en el
+ *  buffer por defecto: lo que cuesta despertar a quien no puede avanzar.
+ */
+#define EXTREMOS 4
+#define BLOQUE 512
+
+static void extremo(int fd, int prod, size_t bytes)
+{
+    char buf[BLOQUE];
+    ssize_t n;
+
+    memset(buf, 'x', sizeof(buf));
+    if (prod){
+        for (; bytes; bytes -= BLOQUE)
+            if (write(fd, buf, BLOQUE) != BLOQUE)
+                exit(1);
+    }else{
+        while ((n = read(fd, buf, BLOQUE)) > 0)
+            ;
+        if (n < 0)
+            exit(1);
+    }
+    exit(0);
+}
+
+static int medir(unsigned int mb)
+{
+    size_t bytes = (size_t)mb * 1024 * 1024 / EXTREMOS;
+    int fd_r[EXTREMOS], fd_w[EXTREMOS];
+    struct rusage ru;
+    pid_t pid;
+    long cs;
+    int i, status, fallo = 0;
+
+    // Medido en un proceso aparte: RUSAGE_CHILDREN solo ve a sus extremos
+    if ((pid = fork()) == 0){
+        // Todos abiertos antes de empezar: un consumidor que llegara tarde
+        // esperaría en open a productores que ya se han ido
+        for (i = 0; i < EXTREMOS; i++){
+            fd_r[i] = abrir(O_RDONLY | O_NONBLOCK);
+            bloquear(fd_r[i]);
+        }
+        for (i = 0; i < EXTREMOS; i++)
+            fd_w[i] = abrir(O_WRONLY);
+
+        for (i = 0; i < EXTREMOS; i++){
+            if (fork() == 0)
+                extremo(fd_r[i], 0, 0);
+            if (fork() == 0)
+                extremo(fd_w[i], 1, bytes);
+        }
+        for (i = 0; i < EXTREMOS; i++){
+            close(fd_r[i]);
+            close(fd_w[i]);
+        }
+
+        for (i = 0; i < 2 * EXTREMOS; i++)
+            if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+                fallo = 1;
+
+        getrusage(RUSAGE_CHILDREN, &ru);
+        cs = ru.ru_nvcsw + ru.ru_nivcsw;
+        printf("%u MB, %d productores y %d consumidores de %d bytes\n",
+                mb, EXTREMOS, EXTREMOS, BLOQUE);
+        printf("cambios de contexto: %ld voluntarios, %ld involuntarios, "
+                "%.1f por MB\n", ru.ru_nvcsw, ru.ru_nivcsw, (double)cs / mb);
+        exit(fallo);
+    }
+
+    return esperar_hijo(pid) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fallos = 0;
+
+    if (argc < 2 || argc > 3){
+        fprintf(stderr, "Uso: %s <dispositivo> [MB]\n", argv[0]);
+        return 2;
+    }
+    dev = argv[1];
+
+    if (argc == 3)
+        return medir(atoi(argv[2]) > 0 ? atoi(argv[2]) : 1);
+
+    fallos += probar("lectura grande", prueba_lectura_grande);
+    fallos += probar("marca de lectura", prueba_marca);
+    fallos += probar("registrador", prueba_registrador);
+    fallos += probar("POLLHUP", prueba_pollhup);
+    fallos += probar("POLLOUT", prueba_pollout);
+    fallos += probar("paquetes", prueba_paquetes);
+    fallos += probar("lectura parcial", prueba_parcial);
+    fallos += probar("info y tamaño", prueba_info);
+    fallos += probar("splice", prueba_splice);
+    fallos += probar("mmap", prueba_mmap);
+
+    // Que quede como estaba para quien venga detrás
+    reiniciar();
+
+    printf("%d pruebas fallidas\n", fallos);
+    return fallos != 0;
+}
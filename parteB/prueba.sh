@@ -0,0 +1,25 @@
+#! /bin/bash
+# Carga el módulo, crea el dispositivo y pasa las pruebas de prueba.c; luego
+# mide los cambios de contexto por MB (./prueba.sh [MB], 64 por defecto).
+# Para comparar con otra versión del módulo basta con cargarla y lanzar
+# ./prueba /var/tmp/fifo <MB>, que solo usa read y write.
+
+DISPOSITIVO=/var/tmp/fifo
+MB=${1:-64}
+
+make all prueba || exit 1
+
+insmod modfifo.ko || exit 1
+major=$(awk '$2 == "fifodev" { print $1 }' /proc/devices)
+rm -f $DISPOSITIVO
+mknod $DISPOSITIVO -m 666 c $major 0
+
+./prueba $DISPOSITIVO
+resultado=$?
+
+./prueba $DISPOSITIVO $MB || resultado=1
+
+rm -f $DISPOSITIVO
+rmmod modfifo
+
+exit $resultado